@@ -25,65 +25,1027 @@
 #include <cstdlib>
 #include <ctime>
 #include <string>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <unordered_map>
+#include <cstdint>
+#include <atomic>
+#include <stdexcept>
+#include <cstring>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <signal.h>
+#include <climits>
+#include <functional>
+#include <deque>
+#include <fstream>
+#include <sys/resource.h>
+#include <new>
+#include <cmath>
+#include <string_view>
+#include <memory>
+#include <condition_variable>
+#include <shared_mutex>
+
+// Static tracepoints (USDT probes) on list operations, for attaching perf or bpftrace in production, e.g.
+//   bpftrace -e 'usdt:./threads_and_mutexes:dll:delete { printf("%p tid %d len %d\n", arg0, arg1, arg2); }'
+// Every probe takes (node address, thread id, list length). A probe compiles to a single nop plus an ELF note
+// describing where its arguments live, and each has a semaphore (dll_<name>_semaphore) that tracers increment
+// while attached, so its arguments are only worked out while something is listening. Until then a probe costs a
+// load and a not-taken branch. Uses <sys/sdt.h> when available, otherwise emits the same note directly (x86-64
+// GCC/Clang only). Build with -DDLL_NO_PROBES to leave them out entirely.
+#if defined(DLL_NO_PROBES)
+#define DLL_PROBE(name, node, tid, len) do {} while (0)
+#elif __has_include(<sys/sdt.h>)
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+#define DLL_PROBE_FIRE(name, node, tid, len) DTRACE_PROBE3(dll, name, node, tid, len)
+#elif defined(__x86_64__) && defined(__GNUC__)
+#define DLL_PROBE_FIRE(name, node, tid, len)                                                             \
+    __asm__ __volatile__("990: nop\n"                                                                    \
+                         ".pushsection .note.stapsdt,\"?\",\"note\"\n"                                    \
+                         ".balign 4\n"                                                                   \
+                         ".4byte 992f-991f, 994f-993f, 3\n"                                              \
+                         "991: .asciz \"stapsdt\"\n"                                                     \
+                         "992: .balign 4\n"                                                              \
+                         "993: .8byte 990b\n"                                                            \
+                         ".8byte _.stapsdt.base\n"                                                       \
+                         ".8byte dll_" #name "_semaphore\n"                                              \
+                         ".asciz \"dll\"\n"                                                              \
+                         ".asciz \"" #name "\"\n"                                                        \
+                         ".asciz \"8@%0 -8@%1 -8@%2\"\n"                                                 \
+                         "994: .balign 4\n"                                                              \
+                         ".popsection\n"                                                                 \
+                         ".ifndef _.stapsdt.base\n"                                                      \
+                         ".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n"         \
+                         ".weak _.stapsdt.base\n"                                                        \
+                         ".hidden _.stapsdt.base\n"                                                      \
+                         "_.stapsdt.base: .space 1\n"                                                    \
+                         ".size _.stapsdt.base, 1\n"                                                     \
+                         ".popsection\n"                                                                 \
+                         ".endif\n"                                                                      \
+                         :                                                                               \
+                         : "nor"((uint64_t)(uintptr_t)(node)), "nor"((int64_t)(tid)), "nor"((int64_t)(len)))
+#endif
+#if defined(DLL_PROBE_FIRE)
+#define DLL_PROBE_SEMAPHORE(name) volatile unsigned short dll_##name##_semaphore __attribute__((section(".probes"))) = 0
+DLL_PROBE_SEMAPHORE(insert);
+DLL_PROBE_SEMAPHORE(delete);
+DLL_PROBE_SEMAPHORE(traverse_done);
+DLL_PROBE_SEMAPHORE(lock_acquire);
+DLL_PROBE_SEMAPHORE(lock_release);
+#define DLL_PROBE(name, node, tid, len)                                                                  \
+    do {                                                                                                 \
+        if (__builtin_expect(dll_##name##_semaphore != 0, 0)) {                                          \
+            DLL_PROBE_FIRE(name, node, tid, len);                                                        \
+        }                                                                                                \
+    } while (0)
+#elif !defined(DLL_PROBE)
+#define DLL_PROBE(name, node, tid, len) do {} while (0)
+#endif
+
+// Kernel thread id of the calling thread (as shown by perf/bpftrace), cached per thread
+[[maybe_unused]] static long current_tid() {
+    static thread_local long tid = syscall(SYS_gettid);
+    return tid;
+}
+
+// Per-worker time accounting. Each worker thread registers a WorkerStats under its role (reader, deleter, ...),
+// and the time it spends waiting on node locks, writing output and sleeping is added to it as it goes; its CPU
+// time is read from the thread's CPU clock. Each also counts the operations it completes (traversals, deletions
+// or nodes swept, by role); only the thread itself updates its counters, so they are never contended.
+// Unregistered threads only pay a null check on a thread-local pointer.
+struct WorkerStats {
+    std::string role;
+    clockid_t cpu_clock;
+    std::chrono::steady_clock::time_point start;
+    // set when the thread unregisters, after which its CPU clock can no longer be read, so cpu_ns and wall_ns
+    // hold the final totals
+    bool done = false;
+    int64_t cpu_ns = 0;
+    int64_t wall_ns = 0;
+    std::atomic<int64_t> lock_ns{ 0 };
+    std::atomic<int64_t> io_ns{ 0 };
+    std::atomic<int64_t> sleep_ns{ 0 };
+    std::atomic<int64_t> ops{ 0 };
+};
+
+class WorkerAccounting {
+public:
+    struct RoleTotals {
+        int threads = 0;
+        int64_t wall_ns = 0, cpu_ns = 0, lock_ns = 0, io_ns = 0, sleep_ns = 0, ops = 0;
+    };
+    WorkerAccounting();
+    ~WorkerAccounting();
+    void register_thread(const std::string& role);
+    void unregister_thread();
+    // the totals so far for each role
+    std::map<std::string, RoleTotals> collect();
+    void dump(std::ostream& out);
+    // dump every interval from a reporter thread, until stop_reporter
+    void start_reporter(std::chrono::milliseconds interval);
+    void stop_reporter();
+
+private:
+    // guards workers, and keeps a thread from unregistering (and exiting) while its CPU clock is being read
+    std::mutex m;
+    std::vector<WorkerStats*> workers;
+    std::thread reporter;
+    std::condition_variable reporter_cv;
+    bool reporter_stop;
+};
+
+// the calling thread's stats, or NULL if it hasn't registered
+static thread_local WorkerStats* worker_stats = NULL;
+
+WorkerAccounting worker_accounting;
+
+// Registers the calling thread for the lifetime of the scope
+class WorkerScope {
+public:
+    WorkerScope(const std::string& role) { worker_accounting.register_thread(role); }
+    ~WorkerScope() { worker_accounting.unregister_thread(); }
+};
+
+// Adds the time until the end of the scope to one of the calling thread's totals, e.g.
+//   AccountedTime io(&WorkerStats::io_ns);
+class AccountedTime {
+public:
+    AccountedTime(std::atomic<int64_t> WorkerStats::*total) : total(total) {
+        if (worker_stats != NULL) {
+            this->start = std::chrono::steady_clock::now();
+        }
+    }
+    ~AccountedTime() {
+        if (worker_stats != NULL) {
+            (worker_stats->*total).fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                                 std::chrono::steady_clock::now() - this->start).count(),
+                                             std::memory_order_relaxed);
+        }
+    }
+
+private:
+    std::atomic<int64_t> WorkerStats::*total;
+    std::chrono::steady_clock::time_point start;
+};
+
+// Count operations completed by the calling thread
+static inline void count_ops(int64_t n = 1) {
+    if (worker_stats != NULL) {
+        worker_stats->ops.store(worker_stats->ops.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+}
+
+// Named gauges (list length, memory, queue depths, ...) registered by whatever owns them, dumped together with
+// the per-role worker totals on demand. Sending the process SIGUSR1 writes a byte to a pipe, which wakes a
+// reporter thread to take the dump, so the signal handler does nothing that isn't async-signal-safe and the
+// workers are never stopped. The gauges are only read when dumping.
+class StatsRegistry {
+public:
+    StatsRegistry();
+    ~StatsRegistry();
+    // returns an id for remove_gauge, which must be called before anything read depends on goes away
+    int add_gauge(const std::string& name, const std::function<double()>& read);
+    void remove_gauge(int id);
+    // print the gauges, then each role's threads, operations (in total and per second since the previous dump)
+    // and lock wait
+    void dump(std::ostream& out);
+    // dump to the end of path (or stderr, if path is empty) each time SIGUSR1 arrives, until stop_signal_reporter
+    void start_signal_reporter(const std::string& path);
+    void stop_signal_reporter();
+    void read_gauges(std::vector<std::pair<std::string, double>>& out);
+
+private:
+    static void on_signal(int);
+    // guards everything below
+    std::mutex m;
+    std::map<int, std::pair<std::string, std::function<double()>>> gauges;
+    int next_gauge;
+    std::map<std::string, int64_t> last_ops;
+    std::chrono::steady_clock::time_point last_dump;
+    std::thread reporter;
+    // the read and write ends of the pipe from the signal handler to the reporter
+    int wake_fds[2];
+};
+
+StatsRegistry stats_registry;
+
+// List operations whose counts and latencies are exported by MetricsExporter
+enum MetricOp { METRIC_INSERT, METRIC_DELETE, METRIC_TRAVERSE, METRIC_OPS };
+
+// upper bounds, in seconds, of the latency histogram buckets (the last bucket is everything slower)
+static const double metric_bounds[] = { 1e-6, 1e-5, 1e-4, 1e-3, 1e-2, 1e-1, 1 };
+static const int metric_buckets = sizeof(metric_bounds) / sizeof(metric_bounds[0]) + 1;
+
+// One thread's counts and latency histograms. Only the owning thread writes them (so plain loads and stores
+// suffice), and the exporter reads them.
+struct OpMetrics {
+    std::atomic<uint64_t> count[METRIC_OPS] = {};
+    std::atomic<uint64_t> sum_ns[METRIC_OPS] = {};
+    std::atomic<uint64_t> buckets[METRIC_OPS][metric_buckets] = {};
+};
+
+// Periodically rewrites a file with the list operation metrics in Prometheus text exposition format, for a
+// monitoring agent to scrape. Each thread records into its own OpMetrics, and the exporter thread sums them
+// when it writes the file, so recording costs a thread two clock reads and a few uncontended stores. The file is
+// written under a temporary name and renamed over the old one, so a scrape never sees a partial file. The
+// StatsRegistry gauges are exported too.
+class MetricsExporter {
+public:
+    MetricsExporter();
+    ~MetricsExporter();
+    bool is_enabled() { return this->enabled.load(std::memory_order_relaxed); }
+    void record(MetricOp op, int64_t ns);
+    // write path now and then every interval, until stop
+    void start(const std::string& path, std::chrono::milliseconds interval);
+    void stop();
+    void write_file(const std::string& path);
+    // fold a finished thread's metrics into the totals
+    void retire(OpMetrics* metrics);
+
+private:
+    std::atomic<bool> enabled;
+    // guards everything below
+    std::mutex m;
+    std::vector<OpMetrics*> threads;
+    OpMetrics retired;
+    std::thread exporter;
+    std::condition_variable exporter_cv;
+    bool exporter_stop;
+};
+
+MetricsExporter metrics_exporter;
+
+// Times the rest of the scope (or until stop) as one operation of the given kind, if metrics are being exported
+class OpTimer {
+public:
+    OpTimer(MetricOp op) : op(op), timing(metrics_exporter.is_enabled()) {
+        if (this->timing) {
+            this->start = std::chrono::steady_clock::now();
+        }
+    }
+    ~OpTimer() { stop(); }
+    void stop() {
+        if (this->timing) {
+            metrics_exporter.record(this->op, std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                                  std::chrono::steady_clock::now() - this->start).count());
+            this->timing = false;
+        }
+    }
+
+private:
+    MetricOp op;
+    bool timing;
+    std::chrono::steady_clock::time_point start;
+};
+
+struct Node;
+
+// One thread's node locks as seen by LockWatchdog: the node it is blocked on, if any, and the nodes it holds,
+// each with when it started waiting for or holding it. Only the thread itself writes these.
+struct LockHolder {
+    static const int max_held = 8;
+    std::string role;
+    long tid;
+    std::atomic<Node*> waiting_for{ NULL };
+    std::atomic<int64_t> waiting_since{ 0 };
+    std::atomic<Node*> held[max_held] = {};
+    std::atomic<int64_t> held_since[max_held] = {};
+};
+
+// Watches node locks for stalls. lock_node and the std::lock paths record which thread holds and waits for which
+// node, and a watchdog thread periodically reports locks held for longer than a threshold (with the holder's role
+// and thread id) and cycles in the wait-for graph (thread -> node it waits for -> thread holding that node), which
+// would mean a deadlock. Waiters inside std::lock aren't recorded, since std::lock can't deadlock by itself.
+// Recording only touches the calling thread's LockHolder and reads a coarse clock; while the watchdog is off it
+// is a single flag check. The watchdog only compares node addresses and never dereferences them.
+class LockWatchdog {
+public:
+    LockWatchdog();
+    ~LockWatchdog();
+    bool is_enabled() { return this->enabled.load(std::memory_order_relaxed); }
+    void waiting(Node* node);
+    void acquired(Node* node);
+    void released(Node* node);
+    // check every threshold, reporting to stderr, until stop
+    void start(std::chrono::milliseconds threshold);
+    void stop();
+    // report stuck locks and deadlocks to out, returning how many were found
+    int check(std::ostream& out);
+    void retire(LockHolder* holder);
+
+private:
+    LockHolder* holder();
+    std::atomic<bool> enabled;
+    int64_t threshold_ns;
+    // guards everything below
+    std::mutex m;
+    std::vector<LockHolder*> holders;
+    std::thread watchdog;
+    std::condition_variable watchdog_cv;
+    bool watchdog_stop;
+};
+
+LockWatchdog lock_watchdog;
+
+// A string too long to be kept inside a node, shared by every node with the same string. Payloads are interned
+// in string_table and freed when the last node referring to them goes, so two nodes with interned strings hold
+// equal strings exactly when they point to the same Payload, and a payload's string never changes.
+struct Payload {
+    std::string str;
+    std::atomic<int> refs{ 1 };
+};
+
+// Interning table of payloads, split into shards by string hash, each with its own lock, so that inserting or
+// deleting nodes with different strings rarely contends. A reference is only ever added under the shard's lock,
+// and the last one only dropped under it, so a payload can't be found in the table while it is being freed.
+class StringTable {
+public:
+    ~StringTable();
+    // the payload for str, with a reference added for the caller; created if str isn't interned yet
+    Payload* intern(const std::string& str);
+    // like intern, but returns NULL rather than creating a payload
+    Payload* find(const std::string& str);
+    void release(Payload* payload);
+    // distinct strings interned, and references to them
+    long get_payloads() { return this->payloads.load(); }
+    long get_references() { return this->references.load(); }
+    size_t get_memory();
+
+private:
+    static const int shard_count = 64;
+    struct alignas(64) Shard {
+        std::mutex m;
+        // keys point into the payloads' own strings
+        std::unordered_map<std::string_view, Payload*> map;
+    };
+    Shard& shard_for(std::string_view str) { return this->shards[std::hash<std::string_view>()(str) >> 58]; }
+
+    Shard shards[shard_count];
+    std::atomic<long> payloads{ 0 };
+    std::atomic<long> references{ 0 };
+};
+
+extern StringTable string_table;
 
 struct Node {
-    std::string data;
-    Node* next;
+    // the node's string. One short enough for std::string's own buffer (every string of the default workload) is
+    // kept in the node: the union is a std::string wide either way, so interning it would only add a payload.
+    // A longer one is interned (see set_str), and only interned strings are compared by address.
+    union {
+        std::string data;
+        Payload* payload;
+    };
+    // identifies the node in a list's mutation log and snapshots (see MutationLog)
+    uint64_t id = 0;
+    // next is atomic so that it can be read by unlocked walks (see delete_at); it is only written under locks
+    std::atomic<Node*> next;
     Node* prev;
     std::mutex m;
+    // set when the node has been deleted in lazy-delete mode but not yet unlinked by the sweeper
+    std::atomic<bool> dead{ false };
+    // set once the node has been unlinked from the list; its next pointer is then left as the node that
+    // followed it, so that a cursor still pinning it can carry on from there
+    std::atomic<bool> unlinked{ false };
+    // set when the string is interned, so that payload is in use rather than data
+    bool interned = false;
+    // references to the node: one from the list while it is linked, one from each cursor pinning it, and one
+    // from each unlinked node whose next pointer still leads to it. The node is freed when they are all gone.
+    std::atomic<int> refs{ 1 };
+    // the cache the node's memory goes back to when it is freed (see NodeAllocator)
+    struct NodeCache* cache;
+    Node() : data() {}
+    ~Node() {
+        if (this->interned) {
+            string_table.release(this->payload);
+        }
+        else {
+            this->data.~basic_string();
+        }
+    }
+    const std::string& str() const { return this->interned ? this->payload->str : this->data; }
+    // Only called once, before the node is published
+    void set_str(const std::string& str) {
+        if (str.size() <= std::string().capacity()) {
+            this->data = str;
+            return;
+        }
+        this->data.~basic_string();
+        this->payload = string_table.intern(str);
+        this->interned = true;
+    }
+};
+
+// Recycles Node memory, so that a list under steady churn (inserts and deletes) stops calling malloc/free.
+// Each thread allocates from its own cache of freed nodes, and every node goes back to the cache it came from.
+// A node freed on another thread (the usual case: the deleter isn't the inserter) is held on that thread in a
+// batch for the owning cache, and the batch is handed over under the cache's lock once it is full; the owner
+// takes the whole handed-back list when its own runs out. When a thread exits, its cache is parked for the next
+// new thread to adopt. Caches never give memory back to the system before exit.
+struct NodeCache {
+    // freed nodes' memory, only touched by the owning thread
+    std::vector<void*> local;
+    // memory handed back by other threads
+    std::mutex remote_m;
+    std::vector<void*> remote;
+};
+
+class NodeAllocator {
+public:
+    NodeAllocator();
+    ~NodeAllocator();
+    Node* alloc();
+    void release(Node* node);
+    // hand the calling thread's partial batches back to their caches, and park its cache
+    void thread_exit();
+    uint64_t get_allocs() { return this->allocs.load(); }
+    uint64_t get_mallocs() { return this->mallocs.load(); }
+
+private:
+    NodeCache* thread_cache();
+    void hand_back(NodeCache* cache, std::vector<void*>& batch);
+
+    static const size_t batch_size = 32;
+    // guards caches and parked
+    std::mutex m;
+    std::vector<NodeCache*> caches;
+    std::vector<NodeCache*> parked;
+    std::atomic<uint64_t> allocs;
+    std::atomic<uint64_t> mallocs;
+};
+
+extern NodeAllocator node_allocator;
+
+// Epoch-based reclamation, for nodes that threads walking the list without locks may still be looking at.
+// Such a walk runs inside an EpochGuard, which announces the global epoch the thread entered in. Retired nodes
+// are tagged with the epoch they were retired in, and the global epoch only advances once every thread inside a
+// guard has caught up with it. So by the time it is two epochs past a node's, no walk that could have reached
+// the node is still going, and the node can be deleted.
+class EpochManager {
+public:
+    EpochManager();
+    ~EpochManager();
+    void enter();
+    void exit();
+    void retire(Node* node);
+    size_t get_backlog();
+
+private:
+    int thread_slot();
+    void try_reclaim();
+
+    static const int max_threads = 256;
+    struct alignas(64) Slot {
+        // epoch the thread entered its guard in, or 0 while it is outside one
+        std::atomic<uint64_t> epoch{ 0 };
+        std::atomic<bool> in_use{ false };
+    };
+    std::atomic<uint64_t> global_epoch;
+    Slot slots[max_threads];
+    std::mutex retire_m;
+    std::vector<std::pair<uint64_t, Node*>> retired;
+};
+
+extern EpochManager node_epochs;
+
+// Keeps the calling thread inside an epoch for as long as it exists
+struct EpochGuard {
+    EpochGuard() { node_epochs.enter(); }
+    ~EpochGuard() { node_epochs.exit(); }
+};
+
+class DoublyLinkedList;
+
+// A reader's position in a DoublyLinkedList that, unlike get_head_str/get_next_str, doesn't keep the node
+// locked. The cursor pins its node with a reference instead, so a deleter never waits for the reader: the
+// node is unlinked but stays allocated while pinned, and the cursor then resumes from the node that followed
+// it when it was deleted. A cursor must not outlive its list.
+class ListCursor {
+public:
+    ListCursor() {
+        this->list = NULL;
+        this->node = NULL;
+    }
+    ~ListCursor() { release(); }
+    ListCursor(const ListCursor&) = delete;
+    ListCursor& operator=(const ListCursor&) = delete;
+    bool valid() { return this->node != NULL; }
+    // a node's string never changes once it is in the list, so it can be read without the node's lock
+    const std::string& data() { return this->node->str(); }
+    void release();
+
+private:
+    friend class DoublyLinkedList;
+    DoublyLinkedList* list;
+    Node* node;
+};
+
+// Lets another thread stop a traversal (see DoublyLinkedList::traverse) before it reaches the end of the list
+class CancelToken {
+public:
+    void cancel() { this->cancelled.store(true, std::memory_order_relaxed); }
+    bool is_cancelled() { return this->cancelled.load(std::memory_order_relaxed); }
+    void reset() { this->cancelled.store(false, std::memory_order_relaxed); }
+
+private:
+    std::atomic<bool> cancelled{ false };
+};
+
+// How a bounded traversal ended
+enum TraverseResult { TRAVERSE_DONE, TRAVERSE_DEADLINE, TRAVERSE_CANCELLED };
+
+// Incrementally maintained hash of the list's contents, so replicas can be compared without shipping the data.
+// Consecutive nodes are grouped into leaf segments of up to group_size nodes, and a binary tree over the leaves
+// keeps a summary of each range. A summary is a polynomial hash (hash, count, base^count), so two ranges combine
+// in O(1) and the root hash depends only on the sequence of strings, not on how they were grouped.
+// Leaves are opened leftwards as nodes are inserted at the head, and an insert/remove costs O(group_size + log n).
+class ListMerkle {
+public:
+    struct Summary {
+        uint64_t hash;
+        uint64_t count;
+        uint64_t power;
+    };
+    ListMerkle(int group_size = 16);
+    void on_insert_head(Node* node);
+    void on_remove(Node* node);
+    uint64_t root_hash();
+    int get_leaf_count();
+    int get_group_size();
+    std::vector<int> diff(ListMerkle& other);
+
+private:
+    struct Leaf {
+        // nodes in list order, with the hash of each node's string
+        std::vector<std::pair<Node*, uint64_t>> items;
+    };
+    void update_leaf(int id);
+    void grow();
+    void diff_subtree(ListMerkle& other, size_t i, size_t j, size_t width, std::vector<int>& out);
+    void collect_leaves(size_t i, size_t width, std::vector<int>& out);
+
+    int group_size;
+    // leaf ids count up from the first leaf opened (at the tail); leaf id is stored at tree[2 * capacity - 1 - id]
+    size_t capacity;
+    std::vector<Leaf> leaves;
+    std::vector<Summary> tree;
+    std::unordered_map<Node*, int> leaf_of;
+    std::mutex m;
+};
+
+// Append-only log of a list's inserts and deletes, for durability without syncing on every change. Records are
+// appended to an in-memory buffer, and commit waits until everything appended so far is on disk. Concurrent
+// committers are grouped: one of them (the leader) writes out the whole buffer and calls fdatasync once for
+// all of them, while the rest (followers) wait for it, so the cost of a sync is shared by every record in the
+// group. The leader can wait commit_delay first, to let a bigger group gather. Records carry a checksum, so a
+// record torn by a crash mid-write ends replay rather than being applied.
+class MutationLog {
+public:
+    enum Kind : uint8_t { INSERT = 1, DELETE = 2 };
+    // open path for appending, truncating it
+    MutationLog(const std::string& path, std::chrono::microseconds commit_delay = std::chrono::microseconds(0));
+    ~MutationLog();
+    void append(Kind kind, uint64_t id, const std::string& data);
+    void commit();
+    // pass each intact record in the log at path to apply, in order; returns the number of records
+    static long replay(const std::string& path,
+                       const std::function<void(Kind kind, uint64_t id, const std::string& data)>& apply);
+    // make a rename or file creation in path's directory durable
+    static void sync_dir(const std::string& path);
+    long get_syncs() { return this->syncs.load(); }
+    long get_synced_records() { return this->synced_records.load(); }
+
+private:
+    int fd;
+    std::chrono::microseconds commit_delay;
+    // guards everything below
+    std::mutex m;
+    std::condition_variable synced;
+    std::string buffer;
+    long buffered_records;
+    // bytes appended, and bytes known to be on disk
+    uint64_t appended;
+    uint64_t durable;
+    // set while a leader is writing and syncing
+    bool syncing;
+    std::atomic<long> syncs;
+    std::atomic<long> synced_records;
+};
+
+// Counting Bloom filter over node strings, so that a membership query for a string that isn't in the list can
+// usually be answered without touching the list. Each string maps to hashes counters (by double hashing two
+// 64-bit hashes), which are incremented when a node with it is inserted and decremented when one is removed.
+// A string is definitely absent if any of its counters is zero. Counters are one byte and saturate at 255,
+// after which they are never decremented (so they can only cause false positives, never false negatives).
+// Counters are updated with atomic operations, so inserts, removals and queries can run concurrently.
+class PayloadBloom {
+public:
+    PayloadBloom(size_t cells, int hashes);
+    void add(const std::string& str);
+    void remove(const std::string& str);
+    bool maybe_contains(const std::string& str);
+    size_t get_cells() { return this->counters.size(); }
+    int get_hashes() { return this->hashes; }
+    size_t get_memory() { return this->counters.size() * sizeof(std::atomic<uint8_t>); }
+    // false-positive rate expected with n distinct strings present
+    double expected_fp_rate(size_t n);
+
+private:
+    size_t cell(uint64_t h1, uint64_t h2, int i) { return (size_t)((h1 + (uint64_t)i * h2) % this->counters.size()); }
+    static void hash_pair(const std::string& str, uint64_t& h1, uint64_t& h2);
+
+    std::vector<std::atomic<uint8_t>> counters;
+    int hashes;
+};
+
+// Each thread's position in a list's traversal. The list shares it with the threads that have an entry, so that
+// a thread can still erase its entry when it exits, or find the list is gone (see ThreadPosOwner).
+struct ThreadPositions {
+    std::map<std::thread::id, Node*> pos;
+    // guards the map itself (each thread's entry is only used by that thread)
+    std::mutex m;
 };
 
+// How the list operations lock the list; see set_granularity
+enum LockGranularity { GRANULARITY_FINE, GRANULARITY_COARSE, GRANULARITY_ADAPTIVE };
+
 class DoublyLinkedList {
 public:
     DoublyLinkedList() {
         this->head = NULL;
         this->length = 0;
+        this->thread_pos = std::make_shared<ThreadPositions>();
+        this->merkle = NULL;
+        this->bloom = NULL;
+        this->bloom_negatives = 0;
+        this->log = NULL;
+        this->next_id = 1;
+        this->lazy_delete = false;
+        this->sweeper_stop = false;
+        this->dead_count = 0;
+        this->unlocked_walk = false;
+        this->lock_wait_ns = 0;
+        this->lock_waits = 0;
+        this->seqlock_reads = false;
+        this->writes_begun = 0;
+        this->writes_ended = 0;
+        this->optimistic_reads = 0;
+        this->fallback_reads = 0;
+        this->granularity = GRANULARITY_FINE;
+        this->coarse = false;
+        this->gate_entries = 0;
+        this->gate_busy_ns = 0;
+        this->adapt_window_start = 0;
+        this->adapt_streak = 0;
+        this->switch_pending = false;
+        this->granularity_switches = 0;
     }
+    ~DoublyLinkedList();
     int get_length() { return this->length; }
     void insert_head(std::string data);
     std::string get_head_str();
     std::string get_next_str();
     void delete_node();
+    void sort(unsigned int num_threads = 0);
+    void for_each(const std::function<void(const std::string&)>& visit);
+    void enable_merkle(int group_size = 16);
+    ListMerkle* get_merkle() { return this->merkle; }
+    void enable_bloom(size_t cells, int hashes = 4);
+    PayloadBloom* get_bloom() { return this->bloom; }
+    bool contains(const std::string& data);
+    uint64_t get_bloom_negatives() { return this->bloom_negatives.load(); }
+    bool recover(const std::string& path);
+    void attach_log(const std::string& path, std::chrono::microseconds commit_delay = std::chrono::microseconds(0));
+    MutationLog* get_log() { return this->log; }
+    void commit();
+    void set_lazy_delete(bool on);
+    int get_dead_count() { return this->dead_count; }
+    bool cursor_begin(ListCursor& cursor);
+    bool cursor_next(ListCursor& cursor);
+    void cursor_erase(ListCursor& cursor);
+    TraverseResult traverse(ListCursor& cursor, const std::function<void(const std::string&)>& visit,
+                            std::chrono::steady_clock::time_point deadline, CancelToken* cancel = NULL);
+    int splice(ListCursor& first, ListCursor& last, DoublyLinkedList& other, ListCursor& position);
+    int split_at(ListCursor& cursor, DoublyLinkedList& rest);
+    void set_unlocked_walk(bool on) { this->unlocked_walk = on; }
+    bool get_unlocked_walk() { return this->unlocked_walk; }
+    bool delete_at(int pos);
+    uint64_t get_lock_wait_ns() { return this->lock_wait_ns.load(); }
+    uint64_t get_lock_waits() { return this->lock_waits.load(); }
+    void set_seqlock_reads(bool on) { this->seqlock_reads = on; }
+    bool get_seqlock_reads() { return this->seqlock_reads; }
+    void snapshot(std::vector<std::string>& out);
+    uint64_t get_optimistic_reads() { return this->optimistic_reads.load(); }
+    uint64_t get_fallback_reads() { return this->fallback_reads.load(); }
+    bool set_granularity(LockGranularity granularity);
+    bool is_coarse() { return this->coarse.load(); }
+    uint64_t get_granularity_switches() { return this->granularity_switches.load(); }
+
+private:
+    // Marks a change to the list's links or contents for the length of the scope, for optimistic readers
+    // (see snapshot). Begun while the nodes involved are locked, so concurrent writers never touch the same links.
+    class ListWrite {
+    public:
+        ListWrite(DoublyLinkedList* list) : list(list) {
+            this->list->writes_begun.fetch_add(1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
+        }
+        ~ListWrite() { this->list->writes_ended.fetch_add(1, std::memory_order_release); }
+
+    private:
+        DoublyLinkedList* list;
+    };
+
+    Node*& thread_position();
+    bool erase_node(Node* node);
+    friend class ListCursor;
+    void mark_unlinked(Node* node, Node* next_node);
+    void unref(Node* node);
+    void step_cursor(ListCursor& cursor);
+    void skip_removed(ListCursor& cursor);
+    void lock_node(Node* node);
+    void unlock_node(Node* node);
+    void lock_nodes(const std::vector<Node*>& nodes);
+    Node* insert_with_id(const std::string& data, uint64_t id);
+    void unlock_nodes(const std::vector<Node*>& nodes);
+    int count_range(Node* first, Node* last);
+    void regroup_merkle();
+    void probe_locked(Node* a, Node* b = NULL, Node* c = NULL);
+    void probe_unlocking(Node* a, Node* b = NULL, Node* c = NULL);
+    void node_inserted(Node* node);
+    void node_removed(Node* node);
+    Node* skip_dead(Node* node);
+    void free_node(Node* node);
+    void sweep();
+    int sweep_pass(int batch);
+    bool enter_gate();
+    void leave_gate();
+    void adapt_granularity();
+
+    std::atomic<Node*> head;
+    // guards changes to head, so that a cursor can pin the head node without locking it
+    std::mutex head_m;
+    std::atomic<int> length;
+    std::shared_ptr<ThreadPositions> thread_pos;
+    // time spent waiting for node locks that were already held, and how many times that happened
+    std::atomic<uint64_t> lock_wait_ns;
+    std::atomic<uint64_t> lock_waits;
+    ListMerkle* merkle;
+    PayloadBloom* bloom;
+    // inserts and deletes are logged here once a log is attached; splice and split_at refuse to run then, since
+    // moving nodes between lists can't be logged
+    MutationLog* log;
+    std::atomic<uint64_t> next_id;
+    // contains queries answered by the bloom filter alone
+    std::atomic<uint64_t> bloom_negatives;
+    // lazy deletion: delete_node only marks nodes dead, and the sweeper thread unlinks them
+    bool lazy_delete;
+    std::thread sweeper;
+    std::atomic<bool> sweeper_stop;
+    std::atomic<int> dead_count;
+    // set when deleters walk the list without locks, so freed nodes must go through epoch reclamation
+    bool unlocked_walk;
+    // seqlock reads: snapshot copies short lists out without node locks, validated against these counters of
+    // writes begun and ended. Freed nodes then also go through epoch reclamation.
+    bool seqlock_reads;
+    std::atomic<uint64_t> writes_begun;
+    std::atomic<uint64_t> writes_ended;
+    std::atomic<uint64_t> optimistic_reads;
+    std::atomic<uint64_t> fallback_reads;
+    static const int seqlock_max_length = 1024;
+    static const int seqlock_max_tries = 8;
+    // lock granularity: unless it is fine, the list operations hold gate for their whole length, shared while
+    // coarse is false (locking nodes as usual) and exclusively while it is true (locking no nodes). coarse only
+    // changes while gate is held exclusively.
+    LockGranularity granularity;
+    std::shared_mutex gate;
+    std::atomic<bool> coarse;
+    // for the adaptive switch: gate entries, the total time operations spent between asking for the gate and
+    // leaving it, and the time (steady clock ns) when the current window of entries began
+    std::atomic<uint64_t> gate_entries;
+    std::atomic<uint64_t> gate_busy_ns;
+    std::atomic<int64_t> adapt_window_start;
+    // windows in a row that called for a switch
+    std::atomic<int> adapt_streak;
+    // set while a switch waits for the gate, holding back new shared entries so it isn't starved by them
+    std::atomic<bool> switch_pending;
+    std::atomic<uint64_t> granularity_switches;
+    static const int adapt_window = 256;
+    static const int64_t adapt_min_window_ns = 50000000;
+    static const int adapt_switch_streak = 3;
+    static constexpr double adapt_fine_above = 4;
+    static constexpr double adapt_coarse_below = 2.5;
+};
+
+// A node of a SegmentList. Links are byte offsets from the start of the segment (0 for none) rather than
+// pointers, so that each process can map the segment at a different address.
+struct SegmentNode {
+    uint64_t next;
+    uint64_t prev;
+    // link in the free list, kept apart from next so a reader still on a deleted node can carry on past it
+    uint64_t free_next;
+    pthread_mutex_t m;
+    // set (under the node's lock) once the node has been deleted, until it is reused
+    bool unlinked;
+    // random strings are at most 9 chars; longer strings are truncated
+    char data[16];
+};
+
+struct SegmentHeader {
+    uint64_t magic;
+    uint64_t capacity;
+    // read without a lock by readers starting a traversal, so it must be atomic without one
+    std::atomic<uint64_t> head;
+    // guards changes to head, and to the head node's prev link on insert
+    pthread_mutex_t head_m;
+    std::atomic<int64_t> length;
+    // guards free_list and used, the node allocator
+    pthread_mutex_t alloc_m;
+    uint64_t free_list;
+    uint64_t used;
+};
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "SegmentHeader::head is shared between processes");
+
+// Position of a reader/deleter in a SegmentList (the offset of the node it has locked), used in place of
+// DoublyLinkedList's thread_pos map since that can't be shared between processes
+struct SegmentCursor {
+    uint64_t pos = 0;
+};
+
+// Doubly linked list whose nodes live in a POSIX shared memory segment, so that several processes can
+// traverse the same list without copying it. Node mutexes are PTHREAD_PROCESS_SHARED and the locking
+// protocol is the same as DoublyLinkedList's: hand-over-hand for traversal, synchronized locking of the
+// node and its neighbours for deletion. The mutexes are also robust, so a process that dies holding one
+// (a reader killed mid-traversal, say) doesn't leave it locked for good (see lock_shared_mutex).
+class SegmentList {
+public:
+    // create a new segment with room for capacity nodes
+    SegmentList(const std::string& name, uint64_t capacity);
+    // map an existing segment created by another process
+    SegmentList(const std::string& name);
+    ~SegmentList();
+    void unlink();
+    int get_length() { return (int)this->header->length.load(); }
+    bool insert_head(const std::string& data);
+    const char* get_head_str(SegmentCursor& cursor);
+    const char* get_next_str(SegmentCursor& cursor);
+    void delete_node(SegmentCursor& cursor);
 
 private:
-    Node* head;
-    int length;
-    std::map<std::thread::id, Node*> thread_pos;
+    void map_segment(int fd, size_t size);
+    SegmentNode* node_at(uint64_t offset) {
+        return (offset == 0) ? NULL : (SegmentNode*)(this->base + offset);
+    }
+    uint64_t offset_of(SegmentNode* node) { return (node == NULL) ? 0 : (uint64_t)((char*)node - this->base); }
+
+    std::string name;
+    char* base;
+    size_t size;
+    SegmentHeader* header;
 };
 
 //
 // DoubleLinkedList member functions
 //
 
+// Free any nodes still left in the list
+DoublyLinkedList::~DoublyLinkedList() {
+    set_lazy_delete(false);
+    Node* node = this->head;
+    while (node != NULL) {
+        Node* next = node->next;
+        free_node(node);
+        node = next;
+    }
+    delete this->merkle;
+    delete this->bloom;
+    delete this->log;
+}
+
+// The list whose gate the calling thread holds (see set_granularity), if any, and the same list again if the
+// gate is held exclusively, so that lock_node and unlock_node can skip the node locks
+static thread_local DoublyLinkedList* held_gate = NULL;
+static thread_local DoublyLinkedList* coarse_gate = NULL;
+// when the calling thread asked for the gate it holds (steady clock ns)
+static thread_local int64_t gate_asked_ns = 0;
+
+static int64_t steady_now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
 // Insert a new node at the head of the list
 void DoublyLinkedList::insert_head(std::string data) {
-    Node* node = new(Node);
-    node->data = data;
+    OpTimer timer(METRIC_INSERT);
+    // in the middle of a traversal, the thread already holds the gate
+    bool entered = enter_gate();
+    insert_with_id(data, this->next_id++);
+    if (entered) {
+        leave_gate();
+    }
+}
+
+// Insert a new node with the given log id at the head of the list (recovery uses this to restore the ids)
+Node* DoublyLinkedList::insert_with_id(const std::string& data, uint64_t id) {
+    Node* node = node_allocator.alloc();
+    node->set_str(data);
+    node->id = id;
     node->next = NULL;
     node->prev = NULL;
-    if (this->head != NULL) {
-        // point any previous head node to this node
-        this->head->prev = node;
-        node->next = this->head;
+    // hold the new node's lock while publishing it, so a reader that finds it through head (and has to
+    // lock it first) is guaranteed to see its data
+    lock_node(node);
+    while (true) {
+        // the old head's prev link is written with the old head locked too: a deleter unlinking the head holds
+        // only its lock (and its successor's) when it checks that the node is still the head. The head node can't
+        // be unlinked while head_m is held, so it is safe to pin while waiting for its lock.
+        Node* old_head;
+        {
+            std::lock_guard<std::mutex> lock_head(this->head_m);
+            old_head = this->head;
+            if (old_head != NULL) {
+                old_head->refs.fetch_add(1);
+            }
+        }
+        if (old_head != NULL) {
+            lock_node(old_head);
+        }
+        bool published = false;
+        {
+            std::lock_guard<std::mutex> lock_head(this->head_m);
+            // if the head was deleted or another node inserted meanwhile, start again with the new head
+            if (this->head == old_head) {
+                ListWrite write(this);
+                if (old_head != NULL) {
+                    // point any previous head node to this node
+                    old_head->prev = node;
+                    node->next = old_head;
+                }
+                // this node becomes the new head
+                this->head = node;
+                // logged and indexed before the node is unlocked, so that it can't be deleted (and logged or
+                // removed from the indexes as such) first
+                if (this->log != NULL) {
+                    this->log->append(MutationLog::INSERT, id, data);
+                }
+                node_inserted(node);
+                published = true;
+            }
+        }
+        if (old_head != NULL) {
+            unlock_node(old_head);
+            unref(old_head);
+        }
+        if (published) {
+            break;
+        }
     }
-    // this node becomes the new head
-    this->head = node;
+    unlock_node(node);
     this->length++;
+    DLL_PROBE(insert, node, current_tid(), this->length);
+    return node;
 }
 
 // Initializes the thread to point (and lock) the head node in the list, and return the data string for that node
 std::string DoublyLinkedList::get_head_str() {
-    std::thread::id t = std::this_thread::get_id();
+    Node*& pos = thread_position();
+    // the gate is held until the traversal reaches the end of the list or deletes a node
+    enter_gate();
 
-    // first acquire lock on node we're going to
-    if (this->head != NULL) {
-        this->head->m.lock();
+    // first acquire lock on node we're going to. With unlocked walks enabled, deleted nodes are reclaimed by
+    // epoch, so the guard keeps the head node allocated even if it is deleted while we wait for its lock; if
+    // that happens, start again from the new head.
+    EpochGuard guard;
+    Node* node = this->head;
+    while (node != NULL) {
+        lock_node(node);
+        if (!node->unlinked.load()) {
+            break;
+        }
+        unlock_node(node);
+        node = this->head;
+    }
+    if (node != NULL) {
+        node = skip_dead(node);
     }
-    this->thread_pos[t] = this->head;
-    if (this->thread_pos[t] != NULL) {
-        return this->thread_pos[t]->data;
+    pos = node;
+    if (pos != NULL) {
+        return pos->str();
     }
     // return empty string if list is empty
+    leave_gate();
     return std::string();
 }
 
@@ -91,153 +1053,5617 @@ std::string DoublyLinkedList::get_head_str() {
 // Returns empty string once the thread has reached the end of the list.
 // Uses hand-over-hand locking to cope with concurrent thread access to list.
 std::string DoublyLinkedList::get_next_str() {
-    std::thread::id t = std::this_thread::get_id();
-    Node* current_node = this->thread_pos[t];
+    Node*& pos = thread_position();
+    Node* current_node = pos;
     if (current_node == NULL) {
         // thread is already at the end of the list, return empty string
         std::cout << "No thread position in list\n";
+        leave_gate();
         return std::string();
     }
     Node* next_node = current_node->next;
     if (next_node != NULL) {
         // acquire lock on node we're going to before updating thread position
-        next_node->m.lock();
-        // update thread position
-        this->thread_pos[t] = next_node;
+        lock_node(next_node);
         // release lock on previous node
-        current_node->m.unlock();
-        return this->thread_pos[t]->data;
+        unlock_node(current_node);
+        // update thread position, passing over any nodes waiting to be swept
+        next_node = skip_dead(next_node);
+        pos = next_node;
+        if (next_node != NULL) {
+            return next_node->str();
+        }
+        DLL_PROBE(traverse_done, current_node, current_tid(), this->length);
+        leave_gate();
+        return std::string();
     }
     // thread is at the last node in the list
     // ensure current node is unlocked and return empty string
-    this->thread_pos[t] = NULL;
-    current_node->m.unlock();
+    pos = NULL;
+    unlock_node(current_node);
+    DLL_PROBE(traverse_done, current_node, current_tid(), this->length);
+    leave_gate();
     return std::string();
 }
 
 // Delete the node at the worker thread's current position.
 // Uses synchronized locking to cope with concurrent thread access to list.
 void DoublyLinkedList::delete_node() {
-    std::thread::id t = std::this_thread::get_id();
-    Node* current_node = this->thread_pos[t];
+    OpTimer timer(METRIC_DELETE);
+    Node*& pos = thread_position();
+    Node* current_node = pos;
 
-    if (current_node != NULL) {
-        // release lock on current node to prevent deadlock when locking below
-        current_node->m.unlock();
-
-        Node* next_node = current_node->next;
-        Node* prev_node = current_node->prev;
+    if (this->lazy_delete) {
+        // just mark the node dead and leave it to the sweeper to unlink. Once the node is unlocked the sweeper
+        // may free it, so it has to be logged and dropped from the merkle tree and Bloom filter first.
+        if (current_node != NULL) {
+            {
+                ListWrite write(this);
+                current_node->dead.store(true);
+            }
+            node_removed(current_node);
+            this->dead_count++;
+            unlock_node(current_node);
+            // only a node actually marked leaves the list
+            this->length--;
+            DLL_PROBE(delete, current_node, current_tid(), this->length);
+        }
+        pos = NULL;
+        leave_gate();
+        return;
+    }
 
-        // create unique lock for current node
-        // use synchronised locking with dependent nodes for critical node deletion sections
-        std::unique_lock<std::mutex> lock_this(current_node->m, std::defer_lock);
+    if (current_node != NULL) {
+        // pin the node so that it stays allocated once unlocked, then unlink it as erase_node does: locked
+        // together with its neighbours, which are revalidated (and the unlinking retried) if they changed while
+        // nothing was locked, e.g. by an insert making a new head
+        current_node->refs.fetch_add(1);
+        unlock_node(current_node);
+        erase_node(current_node);
+        unref(current_node);
+    }
+    // clear the thread's position in the list
+    pos = NULL;
+    leave_gate();
+}
 
-        if (next_node == NULL && prev_node == NULL) {
-            // this is the only node in the list
-            lock_this.lock();
-            this->head = NULL;
+// Merge two sorted chains (linked through next only) by relinking their nodes, and return the first node.
+// Ties are taken from the first chain so that the sort is stable.
+static Node* merge_chains(Node* a, Node* b) {
+    Node* first = NULL;
+    Node* tail = NULL;
+    while (a != NULL && b != NULL) {
+        Node* taken;
+        if (!(a->interned && b->interned && a->payload == b->payload) && b->str() < a->str()) {
+            taken = b;
+            b = b->next;
         }
-        else if (next_node == NULL) {
-            // this is the last node in the list
-            std::unique_lock<std::mutex> lock_prev(prev_node->m, std::defer_lock);
-            std::lock(lock_prev, lock_this);
-            prev_node->next = NULL;
+        else {
+            taken = a;
+            a = a->next;
         }
-        else if (prev_node == NULL) {
-            // this is the head node
-            std::unique_lock<std::mutex> lock_next(next_node->m, std::defer_lock);
-            std::lock(lock_this, lock_next);
-            next_node->prev = NULL;
-            this->head = next_node;
+        if (tail == NULL) {
+            first = taken;
         }
         else {
-            // this node has surrounding nodes
-            std::unique_lock<std::mutex> lock_prev(prev_node->m, std::defer_lock);
-            std::unique_lock<std::mutex> lock_next(next_node->m, std::defer_lock);
-            std::lock(lock_prev, lock_this, lock_next);
-            prev_node->next = next_node;
-            next_node->prev = prev_node;
+            tail->next = taken;
         }
+        tail = taken;
     }
-    // clear the thread's position in the list
-    this->thread_pos[t] = NULL;
-    // free dynamically-allocated memory for the node now there should be no references left to it
-    delete current_node;
-    // update list length
-    this->length--;
+    Node* rest = (a != NULL) ? a : b;
+    if (tail == NULL) {
+        return rest;
+    }
+    tail->next = rest;
+    return first;
 }
 
-// random string generator declaration
-std::string get_random_str();
+// Merge sort a NULL-terminated chain bottom-up, and return the new first node.
+// bins[i] holds a sorted run of 2^i nodes, with earlier nodes in higher bins, so runs only
+// ever need merging and the chain is never walked to find a midpoint.
+static Node* merge_sort_chain(Node* first) {
+    Node* bins[64] = { NULL };
+    while (first != NULL) {
+        Node* run = first;
+        first = first->next;
+        run->next = NULL;
+        int i = 0;
+        for (; bins[i] != NULL; i++) {
+            run = merge_chains(bins[i], run);
+            bins[i] = NULL;
+        }
+        bins[i] = run;
+    }
+    Node* sorted = NULL;
+    for (int i = 0; i < 64; i++) {
+        if (bins[i] != NULL) {
+            sorted = merge_chains(bins[i], sorted);
+        }
+    }
+    return sorted;
+}
 
-void worker_func_1(DoublyLinkedList& dll);
-void worker_func_2(DoublyLinkedList& dll);
+// Sort the list in place by string data, relinking nodes rather than copying their strings.
+// As with insert_head, the caller must have exclusive use of the list; sort checks what it can of that rather
+// than waiting for it. The sweeper is stopped for the length of the sort, the gate (see set_granularity) is taken
+// exclusively unless the list is fine, and every node lock is taken with try_lock. If one is already held,
+// another thread is part way through an operation, and sort throws std::logic_error without changing the list.
+// Seqlock readers (see snapshot) can't be shut out that way, so the relinking counts as a single write to them.
+// The list is cut into one segment per thread and the segments are sorted in parallel, then merged
+// pairwise (again in parallel) until one chain is left. The prev links and head are fixed up at the end.
+void DoublyLinkedList::sort(unsigned int num_threads) {
+    if (num_threads == 0) {
+        num_threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    if (held_gate == this) {
+        throw std::logic_error("sort: called part way through a traversal of the same list");
+    }
+    bool lazy = this->lazy_delete;
+    if (lazy) {
+        set_lazy_delete(false);
+    }
+    bool gated = (this->granularity != GRANULARITY_FINE);
+    if (gated) {
+        this->gate.lock();
+    }
+    // lock and count the nodes actually linked, since in lazy-delete mode these include dead ones
+    int total = 0;
+    for (Node* node = this->head; node != NULL; node = node->next) {
+        if (!node->m.try_lock()) {
+            for (Node* locked = this->head; locked != node; locked = locked->next) {
+                locked->m.unlock();
+            }
+            if (gated) {
+                this->gate.unlock();
+            }
+            if (lazy) {
+                set_lazy_delete(true);
+            }
+            throw std::logic_error("sort: the list is in use by another thread");
+        }
+        total++;
+    }
+    // not worth starting a thread for less than this many nodes
+    const int min_segment = 4096;
+    int segments = std::max(1, std::min((int)num_threads, total / min_segment));
+    if (total == 0) {
+        if (gated) {
+            this->gate.unlock();
+        }
+        if (lazy) {
+            set_lazy_delete(true);
+        }
+        return;
+    }
+    // seqlock readers take no node locks, so the rest of the sort is one long write that any snapshot
+    // overlapping it sees and retries
+    ListWrite write(this);
 
-int main() {
-    // cast time_t to unsigned int for random seed, to prevent warning
-    std::srand((unsigned int)std::time(NULL));
+    // cut the list into segments of roughly equal length
+    std::vector<Node*> chains;
+    Node* node = this->head;
+    for (int s = 0; s < segments && node != NULL; s++) {
+        int count = total / segments + (s < total % segments ? 1 : 0);
+        chains.push_back(node);
+        for (int i = 1; i < count; i++) {
+            node = node->next;
+        }
+        Node* next = node->next;
+        node->next = NULL;
+        node = next;
+    }
 
-    // initialize doubly linked list to start with 140 nodes
-    DoublyLinkedList dll;
-    const int total_nodes = 140;
-    for (int i = 0; i < total_nodes; i++) {
-        std::string data = get_random_str();
-        dll.insert_head(data);
+    // sort each segment on its own thread (the first one on this thread)
+    std::vector<std::thread> workers;
+    for (size_t s = 1; s < chains.size(); s++) {
+        workers.emplace_back([&chains, s]() { chains[s] = merge_sort_chain(chains[s]); });
+    }
+    chains[0] = merge_sort_chain(chains[0]);
+    for (std::thread& w : workers) {
+        w.join();
     }
 
-    // start worker threads and wait until completion (for all nodes to be deleted)
-    std::thread t1(worker_func_1, std::ref(dll));
-    std::thread t2(worker_func_2, std::ref(dll));
-    t1.join();
-    t2.join();
+    // merge sorted segments pairwise until a single chain is left
+    while (chains.size() > 1) {
+        std::vector<Node*> merged((chains.size() + 1) / 2);
+        workers.clear();
+        for (size_t k = 1; 2 * k + 1 < chains.size(); k++) {
+            workers.emplace_back([&chains, &merged, k]() {
+                merged[k] = merge_chains(chains[2 * k], chains[2 * k + 1]);
+            });
+        }
+        merged[0] = merge_chains(chains[0], chains[1]);
+        for (std::thread& w : workers) {
+            w.join();
+        }
+        // an odd chain out is carried over to the next round as it is
+        if (chains.size() % 2 == 1) {
+            merged.back() = chains.back();
+        }
+        chains.swap(merged);
+    }
 
-    return 0;
-}
+    // restore prev links along the sorted chain, then let go of the nodes
+    Node* prev = NULL;
+    for (node = chains[0]; node != NULL; node = node->next) {
+        node->prev = prev;
+        prev = node;
+    }
+    this->head = chains[0];
+    for (node = chains[0]; node != NULL; node = node->next) {
+        node->m.unlock();
+    }
 
-// Return a random string of chars in {a-z} with length (3, 9)
-std::string get_random_str() {
-    int str_len = rand() % 7 + 3;
-    std::string random_str;
-    for (int i = 0; i < str_len; i++) {
-        // pick a random char a-z
-        char tmp = 'a' + rand() % 26;
-        random_str.push_back(tmp);
+    // the relinked nodes no longer match the merkle segments, so regroup them
+    regroup_merkle();
+    if (gated) {
+        this->gate.unlock();
+    }
+    if (lazy) {
+        set_lazy_delete(true);
     }
-    return random_str;
 }
 
-// First worker thread - repeat: concatenate data from all nodes in list and print out at the end of the list
-void worker_func_1(DoublyLinkedList& dll) {
-    while (dll.get_length() > 0) {
-        std::string concatenated;
-        // initialize thread position and point
-        std::string current = dll.get_head_str();
-        // check for empty string to indicate when end of list has been reached
-        while (!current.empty()) {
-            concatenated += current;
-            current = dll.get_next_str();
+// Visit each node's string in list order, using hand-over-hand locking.
+// The string is passed by reference from the node itself; it is only guaranteed to stay valid after the callback
+// returns if the caller is the only thread that deletes nodes.
+void DoublyLinkedList::for_each(const std::function<void(const std::string&)>& visit) {
+    bool entered = enter_gate();
+    Node* node = this->head;
+    if (node != NULL) {
+        lock_node(node);
+    }
+    while (node != NULL) {
+        if (!node->dead.load()) {
+            visit(node->str());
         }
-        std::cout << "\nConcatenated thread: " << concatenated << "\n";
+        Node* next_node = node->next;
+        if (next_node != NULL) {
+            lock_node(next_node);
+        }
+        unlock_node(node);
+        if (next_node == NULL) {
+            DLL_PROBE(traverse_done, node, current_tid(), this->length);
+        }
+        node = next_node;
+    }
+    if (entered) {
+        leave_gate();
     }
-    std::cout << "List empty: worker 1 stopping\n";
 }
 
-// Worker thread 2 - choose a node at random to delete from list, sleep for 500ms and repeat
-void worker_func_2(DoublyLinkedList& dll) {
-    while (dll.get_length() > 0) {
-        // choose a node to delete from the list at random
-        int pos_to_delete = rand() % dll.get_length();
-
-        // initialize thread position and point to first node
-        std::string tmp = dll.get_head_str();
-        for (int i = 0; i < pos_to_delete; i++) {
-            // use this to iterate over nodes until we reach the target node
-            tmp = dll.get_next_str();
+// Copy the live nodes' strings out in list order. With seqlock reads on, a list of up to seqlock_max_length
+// nodes is first copied optimistically, following next pointers without taking any node locks (epoch
+// reclamation keeps every node reached allocated), and the copy is kept only if no write began or was under way
+// while it was made. Node strings never change while a node is allocated, so a copy is only ever inconsistent,
+// never torn. After seqlock_max_tries failed attempts, or for longer lists, this falls back to hand-over-hand
+// locking as in for_each.
+void DoublyLinkedList::snapshot(std::vector<std::string>& out) {
+    EpochGuard guard;
+    if (this->seqlock_reads && this->length <= seqlock_max_length) {
+        for (int attempt = 0; attempt < seqlock_max_tries; attempt++) {
+            uint64_t begun = this->writes_begun.load(std::memory_order_acquire);
+            if (this->writes_ended.load(std::memory_order_acquire) != begun) {
+                // a write is under way
+                std::this_thread::yield();
+                continue;
+            }
+            out.clear();
+            Node* last = NULL;
+            for (Node* node = this->head.load(std::memory_order_acquire); node != NULL;
+                 node = node->next.load(std::memory_order_acquire)) {
+                if (!node->dead.load(std::memory_order_relaxed)) {
+                    out.push_back(node->str());
+                }
+                last = node;
+            }
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (this->writes_begun.load(std::memory_order_relaxed) == begun) {
+                this->optimistic_reads.fetch_add(1, std::memory_order_relaxed);
+                if (last != NULL) {
+                    DLL_PROBE(traverse_done, last, current_tid(), this->length);
+                }
+                return;
+            }
         }
-        // delete the node at the current target position
-        dll.delete_node();
+        this->fallback_reads.fetch_add(1, std::memory_order_relaxed);
+    }
+    out.clear();
+    for_each([&out](const std::string& data) { out.push_back(data); });
+}
 
-        std::this_thread::sleep_for(std::chrono::milliseconds(500));
+// Start maintaining a merkle tree of segment hashes over the list's current contents.
+// Like insert_head, this must be called while the caller has exclusive use of the list.
+void DoublyLinkedList::enable_merkle(int group_size) {
+    if (this->merkle != NULL) {
+        return;
     }
-    std::cout << "List empty: worker 2 stopping\n";
+    std::vector<Node*> nodes;
+    for (Node* node = this->head; node != NULL; node = node->next) {
+        if (!node->dead.load()) {
+            nodes.push_back(node);
+        }
+    }
+    this->merkle = new ListMerkle(group_size);
+    // replay the nodes as head insertions, from the tail forwards
+    for (auto it = nodes.rbegin(); it != nodes.rend(); ++it) {
+        this->merkle->on_insert_head(*it);
+    }
+}
+
+// Start maintaining a counting Bloom filter over the strings in the list, for contains.
+// Like insert_head, this must be called while the caller has exclusive use of the list.
+void DoublyLinkedList::enable_bloom(size_t cells, int hashes) {
+    if (this->bloom != NULL) {
+        return;
+    }
+    this->bloom = new PayloadBloom(cells, hashes);
+    for (Node* node = this->head; node != NULL; node = node->next) {
+        if (!node->dead.load()) {
+            this->bloom->add(node->str());
+        }
+    }
+}
+
+// Check whether a node with the given string is in the list. If the Bloom filter rules the string out, or the
+// string is too long to be kept in a node but isn't interned, the list isn't touched; otherwise the whole list is
+// traversed with hand-over-hand locking, comparing interned strings by address.
+bool DoublyLinkedList::contains(const std::string& data) {
+    if (this->bloom != NULL && !this->bloom->maybe_contains(data)) {
+        this->bloom_negatives.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    bool found = false;
+    if (data.size() <= std::string().capacity()) {
+        for_each([&data, &found](const std::string& s) { found = found || s == data; });
+        return found;
+    }
+    Payload* payload = string_table.find(data);
+    if (payload == NULL) {
+        return false;
+    }
+    for_each([payload, &found](const std::string& s) { found = found || &s == &payload->str; });
+    string_table.release(payload);
+    return found;
+}
+
+// Rebuild the list from a log attached at path by an earlier run: the checkpoint written when the log was
+// attached (path.snap) is loaded, then the inserts and deletes logged since (path.log) are replayed over it.
+// Replay stops at the first torn record, so whatever the last run committed is restored. A crash part way through
+// attach_log can leave the new checkpoint next to the old log, whose changes the checkpoint already includes, so
+// replay is idempotent: an insert of an id that is already in the list is skipped (and a delete of an id that
+// isn't, as before). Must be called on an empty list, before a log is attached. Returns false if there was no
+// checkpoint.
+bool DoublyLinkedList::recover(const std::string& path) {
+    if (access((path + ".snap").c_str(), F_OK) != 0) {
+        return false;
+    }
+    std::unordered_map<uint64_t, Node*> nodes;
+    uint64_t max_id = 0;
+    auto apply = [this, &nodes, &max_id](MutationLog::Kind kind, uint64_t id, const std::string& data) {
+        if (kind == MutationLog::INSERT) {
+            if (nodes.count(id) == 0) {
+                nodes[id] = insert_with_id(data, id);
+            }
+            max_id = std::max(max_id, id);
+        }
+        else {
+            auto it = nodes.find(id);
+            if (it != nodes.end()) {
+                erase_node(it->second);
+                nodes.erase(it);
+            }
+        }
+    };
+    MutationLog::replay(path + ".snap", apply);
+    MutationLog::replay(path + ".log", apply);
+    this->next_id = max_id + 1;
+    return true;
+}
+
+// Start logging inserts and deletes to path.log. A checkpoint of the list as it stands is written first (as the
+// inserts that would rebuild it, tail first) to path.snap, replacing any older checkpoint in one rename, and the
+// log is started afresh. The directory is synced after the rename, before the old log is truncated, so a crash
+// can't leave the old checkpoint with an emptied log; the reverse, the new checkpoint with the old log, is
+// handled by recover. Changes become durable when commit returns. Like insert_head, this must be called while
+// the caller has exclusive use of the list.
+void DoublyLinkedList::attach_log(const std::string& path, std::chrono::microseconds commit_delay) {
+    if (this->log != NULL) {
+        return;
+    }
+    std::vector<Node*> nodes;
+    for (Node* node = this->head; node != NULL; node = node->next) {
+        if (!node->dead.load()) {
+            nodes.push_back(node);
+        }
+    }
+    {
+        MutationLog snap(path + ".snap.tmp");
+        for (auto it = nodes.rbegin(); it != nodes.rend(); ++it) {
+            snap.append(MutationLog::INSERT, (*it)->id, (*it)->str());
+        }
+        snap.commit();
+    }
+    if (rename((path + ".snap.tmp").c_str(), (path + ".snap").c_str()) != 0) {
+        throw std::runtime_error("rename " + path + ".snap: " + std::strerror(errno));
+    }
+    MutationLog::sync_dir(path);
+    this->log = new MutationLog(path + ".log", commit_delay);
+    MutationLog::sync_dir(path);
+}
+
+// Wait until every change logged so far (by any thread) is on disk; does nothing if no log is attached
+void DoublyLinkedList::commit() {
+    if (this->log != NULL) {
+        this->log->commit();
+    }
+}
+
+// Switch lazy deletion on or off. While it is on, delete_node only marks the node dead (readers skip over
+// dead nodes) and a low-priority sweeper thread unlinks and frees dead nodes in batches.
+void DoublyLinkedList::set_lazy_delete(bool on) {
+    if (on == this->lazy_delete) {
+        return;
+    }
+    this->lazy_delete = on;
+    if (on) {
+        this->sweeper_stop = false;
+        this->sweeper = std::thread(&DoublyLinkedList::sweep, this);
+    }
+    else {
+        this->sweeper_stop = true;
+        this->sweeper.join();
+    }
+}
+
+// Choose how the list operations (insert_head, a traversal from get_head_str until get_next_str reaches the end,
+// one through to delete_node, for_each and the cursor operations) lock the list:
+//   fine:     hand-over-hand node locks, as always
+//   coarse:   each operation locks the whole list, and no nodes. Cheaper per node, but operations run one at a time.
+//   adaptive: switch between the two as contention changes. Over windows of at least adapt_window operations
+//             and 50 ms, the time operations spent between asking for the list and finishing with it (waiting
+//             included) is divided by the length of the window. That is the average number of operations in
+//             progress, which means the same in both modes: how many operations coarse locking would have to
+//             queue. Above adapt_fine_above, switch to node locks; below adapt_coarse_below, switch to coarse
+//             locking, where node locks are mostly overhead. The gap between the two thresholds, and only
+//             switching after adapt_switch_streak windows in a row call for it, keep the mode from flapping.
+// Unless it is fine, each operation holds a reader-writer gate for its whole length: shared for node locking and
+// exclusive for coarse locking. Switching takes the gate exclusively, so it waits for every operation in progress
+// (in the old mode) to finish, and operations re-check the mode once they have the gate.
+// Lazy deletion, unlocked walks and seqlock reads go around the locks, so the granularity can only be changed
+// from fine while they are off (returns false otherwise), and they mustn't be turned on until it is fine again.
+// Each traversal must be run to its end or a deletion, and a thread may only be part way through one gated list
+// at a time. Like insert_head, this must be called while the caller has exclusive use of the list.
+bool DoublyLinkedList::set_granularity(LockGranularity granularity) {
+    if (granularity != GRANULARITY_FINE && (this->lazy_delete || this->unlocked_walk || this->seqlock_reads)) {
+        return false;
+    }
+    this->granularity = granularity;
+    this->coarse = (granularity == GRANULARITY_COARSE);
+    this->adapt_window_start = steady_now_ns();
+    return true;
+}
+
+// Take the gate for an operation, unless the calling thread holds it already. Returns whether it was taken.
+bool DoublyLinkedList::enter_gate() {
+    if (this->granularity == GRANULARITY_FINE || held_gate == this) {
+        return false;
+    }
+    adapt_granularity();
+    gate_asked_ns = steady_now_ns();
+    while (true) {
+        bool exclusive = this->coarse.load();
+        while (!exclusive && this->switch_pending.load()) {
+            std::this_thread::yield();
+        }
+        if (exclusive) {
+            this->gate.lock();
+        }
+        else {
+            this->gate.lock_shared();
+        }
+        if (exclusive == this->coarse.load()) {
+            held_gate = this;
+            coarse_gate = exclusive ? this : NULL;
+            return true;
+        }
+        // switched while we waited
+        if (exclusive) {
+            this->gate.unlock();
+        }
+        else {
+            this->gate.unlock_shared();
+        }
+    }
+}
+
+void DoublyLinkedList::leave_gate() {
+    if (held_gate != this) {
+        return;
+    }
+    if (this->granularity == GRANULARITY_ADAPTIVE) {
+        // only the part of the operation inside the current window counts towards it
+        int64_t since = std::max(gate_asked_ns, this->adapt_window_start.load(std::memory_order_relaxed));
+        this->gate_busy_ns.fetch_add((uint64_t)std::max<int64_t>(0, steady_now_ns() - since),
+                                     std::memory_order_relaxed);
+    }
+    if (coarse_gate == this) {
+        this->gate.unlock();
+    }
+    else {
+        this->gate.unlock_shared();
+    }
+    held_gate = NULL;
+    coarse_gate = NULL;
+}
+
+// Count a gate entry, and at the end of each window decide whether to switch. Called without the gate held.
+void DoublyLinkedList::adapt_granularity() {
+    if (this->granularity != GRANULARITY_ADAPTIVE ||
+        (this->gate_entries.fetch_add(1, std::memory_order_relaxed) + 1) % adapt_window != 0) {
+        return;
+    }
+    int64_t now = steady_now_ns();
+    int64_t elapsed = now - this->adapt_window_start.load();
+    if (elapsed < adapt_min_window_ns) {
+        return;
+    }
+    this->adapt_window_start = now;
+    double in_progress = (double)this->gate_busy_ns.exchange(0) / elapsed;
+    bool was_coarse = this->coarse.load();
+    if (!(was_coarse ? in_progress > adapt_fine_above : in_progress < adapt_coarse_below)) {
+        this->adapt_streak = 0;
+        return;
+    }
+    if (++this->adapt_streak >= adapt_switch_streak) {
+        this->adapt_streak = 0;
+        // wait for every operation in progress to finish
+        this->switch_pending = true;
+        std::unique_lock<std::shared_mutex> lock(this->gate);
+        if (this->coarse.load() == was_coarse) {
+            this->coarse = !was_coarse;
+            this->granularity_switches++;
+        }
+        this->switch_pending = false;
+        // the drain above isn't load, so start a fresh window
+        this->gate_busy_ns = 0;
+        this->adapt_window_start = steady_now_ns();
+    }
+}
+
+// Sweeper thread: periodically unlink dead nodes, a batch at a time
+void DoublyLinkedList::sweep() {
+    // run at the lowest priority, so sweeping only uses otherwise idle CPU
+    setpriority(PRIO_PROCESS, (id_t)current_tid(), 19);
+    WorkerScope scope("sweeper");
+    const int batch = 64;
+    while (!this->sweeper_stop) {
+        int swept = (this->dead_count == 0) ? 0 : sweep_pass(batch);
+        count_ops(swept);
+        if (swept < batch) {
+            AccountedTime sleeping(&WorkerStats::sleep_ns);
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+    }
+}
+
+// Walk the list hand-over-hand and unlink up to batch dead nodes, returning how many were unlinked.
+// A dead node is unlinked while holding the locks on it and its neighbours, all taken in list order like a
+// traversal. The head node is left in place even if dead: get_head_str locks it without holding any other
+// node, so a reader could be waiting on it.
+int DoublyLinkedList::sweep_pass(int batch) {
+    Node* prev_node = this->head;
+    if (prev_node == NULL) {
+        return 0;
+    }
+    int unlinked = 0;
+    lock_node(prev_node);
+    while (unlinked < batch) {
+        Node* node = prev_node->next;
+        if (node == NULL) {
+            break;
+        }
+        lock_node(node);
+        if (!node->dead.load()) {
+            unlock_node(prev_node);
+            prev_node = node;
+            continue;
+        }
+        Node* next_node = node->next;
+        if (next_node != NULL) {
+            lock_node(next_node);
+        }
+        {
+            ListWrite write(this);
+            if (next_node != NULL) {
+                next_node->prev = prev_node;
+            }
+            prev_node->next = next_node;
+            mark_unlinked(node, next_node);
+        }
+        if (next_node != NULL) {
+            unlock_node(next_node);
+        }
+        unlock_node(node);
+        unref(node);
+        this->dead_count--;
+        unlinked++;
+    }
+    unlock_node(prev_node);
+    return unlinked;
+}
+
+// Pass over dead nodes, starting from the locked node given, using hand-over-hand locking.
+// Returns the first live node (still locked), or NULL if there are none left.
+Node* DoublyLinkedList::skip_dead(Node* node) {
+    while (node != NULL && node->dead.load()) {
+        Node* next_node = node->next;
+        if (next_node != NULL) {
+            lock_node(next_node);
+        }
+        unlock_node(node);
+        node = next_node;
+    }
+    return node;
+}
+
+// Record that a node has been unlinked, while it and next_node (its successor, if any) are still locked.
+// The node keeps its next pointer and takes a reference on next_node, so that a cursor pinning the node can
+// still move on from it.
+void DoublyLinkedList::mark_unlinked(Node* node, Node* next_node) {
+    if (next_node != NULL) {
+        next_node->refs.fetch_add(1);
+    }
+    node->unlinked.store(true);
+}
+
+// Drop a reference to a node, freeing it once none are left. An unlinked node's reference on its successor
+// goes with it, which may free that node in turn.
+void DoublyLinkedList::unref(Node* node) {
+    while (node != NULL && node->refs.fetch_sub(1) == 1) {
+        Node* next_node = node->unlinked.load() ? node->next.load() : NULL;
+        free_node(node);
+        node = next_node;
+    }
+}
+
+// Point the cursor at the first live node in the list. Returns false if there are none.
+bool DoublyLinkedList::cursor_begin(ListCursor& cursor) {
+    bool entered = enter_gate();
+    cursor.release();
+    cursor.list = this;
+    {
+        // the head node can't be unlinked while head_m is held, so it is safe to pin
+        std::lock_guard<std::mutex> lock_head(this->head_m);
+        cursor.node = this->head;
+        if (cursor.node != NULL) {
+            cursor.node->refs.fetch_add(1);
+        }
+    }
+    skip_removed(cursor);
+    if (entered) {
+        leave_gate();
+    }
+    return cursor.valid();
+}
+
+// Move the cursor on to the next live node. If the cursor's node has been deleted since the cursor reached it,
+// this is the first live node after the one that followed it at the time. Returns false at the end of the list.
+bool DoublyLinkedList::cursor_next(ListCursor& cursor) {
+    Node* node = cursor.node;
+    if (node == NULL) {
+        return false;
+    }
+    bool entered = enter_gate();
+    step_cursor(cursor);
+    skip_removed(cursor);
+    if (!cursor.valid()) {
+        DLL_PROBE(traverse_done, node, current_tid(), this->length);
+    }
+    if (entered) {
+        leave_gate();
+    }
+    return cursor.valid();
+}
+
+// Move a cursor from its node to the node that follows it, whether or not that is live
+void DoublyLinkedList::step_cursor(ListCursor& cursor) {
+    Node* node = cursor.node;
+    // lock the node just long enough to pin its successor. A linked node's successor can't be unlinked without
+    // this lock, and an unlinked node holds a reference on its successor, so either way the successor is alive.
+    lock_node(node);
+    Node* next_node = node->next;
+    if (next_node != NULL) {
+        next_node->refs.fetch_add(1);
+    }
+    unlock_node(node);
+    cursor.node = next_node;
+    unref(node);
+}
+
+// Move a cursor off any unlinked or dead node it is on, to the next live node (or the end of the list)
+void DoublyLinkedList::skip_removed(ListCursor& cursor) {
+    while (cursor.node != NULL && (cursor.node->unlinked.load() || cursor.node->dead.load())) {
+        step_cursor(cursor);
+    }
+}
+
+// Delete the node at the cursor. Only the node and its neighbours are locked, and only while unlinking it;
+// since readers using cursors don't hold node locks, this never waits for a slow reader. The cursor keeps the
+// node pinned, and its next cursor_next moves on to the node that followed it.
+void DoublyLinkedList::cursor_erase(ListCursor& cursor) {
+    if (cursor.node != NULL) {
+        bool entered = enter_gate();
+        erase_node(cursor.node);
+        if (entered) {
+            leave_gate();
+        }
+    }
+}
+
+// Unlink a node that the caller holds no locks on, but has pinned or is otherwise keeping allocated.
+// The node and its neighbours are locked together, and the links validated and retried if they changed while
+// nothing was locked. Returns false if the node had already been deleted by someone else.
+bool DoublyLinkedList::erase_node(Node* node) {
+    while (true) {
+        // pin the neighbours while the node is locked (so they are still linked), then lock all three together
+        lock_node(node);
+        if (node->unlinked.load() || node->dead.load()) {
+            unlock_node(node);
+            return false;
+        }
+        Node* prev_node = node->prev;
+        Node* next_node = node->next;
+        if (prev_node != NULL) {
+            prev_node->refs.fetch_add(1);
+        }
+        if (next_node != NULL) {
+            next_node->refs.fetch_add(1);
+        }
+        unlock_node(node);
+
+        std::unique_lock<std::mutex> lock_this(node->m, std::defer_lock);
+        std::unique_lock<std::mutex> lock_prev;
+        std::unique_lock<std::mutex> lock_next;
+        if (prev_node != NULL) {
+            lock_prev = std::unique_lock<std::mutex>(prev_node->m, std::defer_lock);
+        }
+        if (next_node != NULL) {
+            lock_next = std::unique_lock<std::mutex>(next_node->m, std::defer_lock);
+        }
+        if (coarse_gate == this) {
+            // the list is locked as a whole
+        }
+        else if (prev_node != NULL && next_node != NULL) {
+            std::lock(lock_prev, lock_this, lock_next);
+        }
+        else if (prev_node != NULL) {
+            std::lock(lock_prev, lock_this);
+        }
+        else if (next_node != NULL) {
+            std::lock(lock_this, lock_next);
+        }
+        else {
+            lock_this.lock();
+        }
+        probe_locked(prev_node, node, next_node);
+
+        // the neighbours may have changed while nothing was locked; if so, start again. With the node locked, an
+        // insert can't make it stop being the head (see insert_with_id), so a head node's prev staying NULL means
+        // head still points to it.
+        bool unchanged = !node->unlinked.load() && node->prev == prev_node && node->next == next_node;
+        if (unchanged) {
+            ListWrite write(this);
+            if (prev_node != NULL) {
+                prev_node->next = next_node;
+            }
+            else {
+                std::lock_guard<std::mutex> lock_head(this->head_m);
+                this->head = next_node;
+            }
+            if (next_node != NULL) {
+                next_node->prev = prev_node;
+            }
+            mark_unlinked(node, next_node);
+            node_removed(node);
+        }
+        probe_unlocking(prev_node, node, next_node);
+        if (lock_prev) {
+            lock_prev.unlock();
+        }
+        if (lock_this) {
+            lock_this.unlock();
+        }
+        if (lock_next) {
+            lock_next.unlock();
+        }
+        unref(prev_node);
+        unref(next_node);
+        if (unchanged) {
+            this->length--;
+            DLL_PROBE(delete, node, current_tid(), this->length);
+            // drop the list's reference; the caller's pin keeps the node allocated
+            unref(node);
+            return true;
+        }
+    }
+}
+
+// Visit the live nodes' strings in list order from the cursor onwards (from the head if the cursor has never been
+// used), stopping early once the deadline passes or the token is cancelled. Since the cursor only pins its node,
+// no lock is held between nodes, so stopping leaves nothing locked. When stopped early, the cursor is left on the
+// first node not yet visited, and passing it back in carries on from there (or from the node that followed it,
+// if it has been deleted meanwhile). The clock is only read every few nodes, so the deadline may be overrun by
+// the time it takes to visit them, and not before the first, so a call always visits at least one node (if any
+// are left) and a caller that keeps calling until TRAVERSE_DONE gets there even if the deadline has passed.
+TraverseResult DoublyLinkedList::traverse(ListCursor& cursor, const std::function<void(const std::string&)>& visit,
+                                          std::chrono::steady_clock::time_point deadline, CancelToken* cancel) {
+    const int clock_interval = 16;
+    bool more = (cursor.list == NULL) ? cursor_begin(cursor) : cursor.valid();
+    for (int visited = 0; more; visited++) {
+        if (cancel != NULL && cancel->is_cancelled()) {
+            return TRAVERSE_CANCELLED;
+        }
+        if (visited > 0 && visited % clock_interval == 0 && std::chrono::steady_clock::now() >= deadline) {
+            return TRAVERSE_DEADLINE;
+        }
+        visit(cursor.data());
+        more = cursor_next(cursor);
+    }
+    return TRAVERSE_DONE;
+}
+
+// Move the nodes from first to last (inclusive, in list order) out of this list and into other, after position,
+// or at other's head if position isn't on a node. Only the nodes at the boundaries are relinked: first and last,
+// their neighbours here, and position and its successor in other, all locked together and validated as in
+// erase_node. The relinking doesn't depend on the length of the range, but counting the moved nodes (for both
+// lengths) and moving their strings between the Bloom filters walks it, so a splice takes time proportional to
+// the number of nodes moved, with the boundaries locked throughout. No other thread may be positioned inside the
+// range or deleting from it, since it would find itself in other; for the same reason neither list may be in
+// lazy-delete mode, where the sweeper could be. Regrouping a merkle tree needs the whole list to itself, so
+// neither list may have one, and neither may have a log attached, since the move wouldn't be logged. Both lists
+// must also use fine lock granularity (see set_granularity). Returns the number of nodes moved, or -1 if a node
+// involved has been deleted, last doesn't follow first, or the cursors aren't on the right lists.
+int DoublyLinkedList::splice(ListCursor& first, ListCursor& last, DoublyLinkedList& other, ListCursor& position) {
+    Node* first_node = first.node;
+    Node* last_node = last.node;
+    Node* pos_node = position.node;
+    if (first_node == NULL || last_node == NULL || &other == this || this->lazy_delete || other.lazy_delete) {
+        return -1;
+    }
+    if (first.list != this || last.list != this || (pos_node != NULL && position.list != &other)) {
+        return -1;
+    }
+    if (this->merkle != NULL || other.merkle != NULL || this->log != NULL || other.log != NULL) {
+        return -1;
+    }
+    if (this->granularity != GRANULARITY_FINE || other.granularity != GRANULARITY_FINE) {
+        return -1;
+    }
+    while (true) {
+        // read the neighbours under each node's lock, pinning them so they stay allocated while unlocked
+        Node* ends[3] = { first_node, last_node, pos_node };
+        Node* neighbours[3] = { NULL, NULL, NULL };
+        for (int i = 0; i < 3; i++) {
+            if (ends[i] == NULL) {
+                continue;
+            }
+            lock_node(ends[i]);
+            neighbours[i] = (i == 0) ? ends[i]->prev : ends[i]->next.load();
+            if (neighbours[i] != NULL) {
+                neighbours[i]->refs.fetch_add(1);
+            }
+            unlock_node(ends[i]);
+        }
+        Node* prev_node = neighbours[0];
+        Node* next_node = neighbours[1];
+        Node* pos_next = neighbours[2];
+        if (pos_node == NULL) {
+            std::lock_guard<std::mutex> lock_head(other.head_m);
+            pos_next = other.head;
+            if (pos_next != NULL) {
+                pos_next->refs.fetch_add(1);
+            }
+        }
+
+        std::vector<Node*> nodes;
+        for (Node* node : { prev_node, first_node, last_node, next_node, pos_node, pos_next }) {
+            if (node != NULL && std::find(nodes.begin(), nodes.end(), node) == nodes.end()) {
+                nodes.push_back(node);
+            }
+        }
+        lock_nodes(nodes);
+        std::unique_lock<std::mutex> lock_head(this->head_m, std::defer_lock);
+        std::unique_lock<std::mutex> lock_other_head(other.head_m, std::defer_lock);
+        std::lock(lock_head, lock_other_head);
+
+        // the neighbours may have changed while nothing was locked; if so, start again
+        bool removed = false;
+        for (Node* node : ends) {
+            removed = removed || (node != NULL && node->unlinked.load());
+        }
+        bool unchanged = !removed && first_node->prev == prev_node && last_node->next == next_node &&
+                         (prev_node != NULL ? prev_node->next == first_node : this->head == first_node) &&
+                         (next_node == NULL || next_node->prev == last_node) &&
+                         (pos_node != NULL ? pos_node->next == pos_next : other.head == pos_next) &&
+                         (pos_next == NULL || pos_next->prev == pos_node);
+        int moved = unchanged ? count_range(first_node, last_node) : -1;
+        if (moved > 0) {
+            ListWrite write(this);
+            ListWrite write_other(&other);
+            if (prev_node != NULL) {
+                prev_node->next = next_node;
+            }
+            else {
+                this->head = next_node;
+            }
+            if (next_node != NULL) {
+                next_node->prev = prev_node;
+            }
+            first_node->prev = pos_node;
+            last_node->next = pos_next;
+            if (pos_node != NULL) {
+                pos_node->next = first_node;
+            }
+            else {
+                other.head = first_node;
+            }
+            if (pos_next != NULL) {
+                pos_next->prev = last_node;
+            }
+            this->length -= moved;
+            other.length += moved;
+            for (Node* node = first_node;; node = node->next) {
+                if (this->bloom != NULL) {
+                    this->bloom->remove(node->str());
+                }
+                if (other.bloom != NULL) {
+                    other.bloom->add(node->str());
+                }
+                if (node == last_node) {
+                    break;
+                }
+            }
+        }
+        lock_head.unlock();
+        lock_other_head.unlock();
+        unlock_nodes(nodes);
+        unref(prev_node);
+        unref(next_node);
+        other.unref(pos_next);
+        if (removed) {
+            return -1;
+        }
+        if (!unchanged) {
+            continue;
+        }
+        if (moved > 0) {
+            // the cursors at the ends of the range now pin nodes of other
+            first.list = &other;
+            last.list = &other;
+        }
+        return moved;
+    }
+}
+
+// Cut the list in two before the cursor's node: it and every node after it move to rest, which must be empty.
+// As with splice, no other thread may be positioned after the cut. The tail is found by walking a second cursor
+// along, so each node is pinned before the last one is let go; if the tail is deleted before the splice, the walk
+// starts again. Returns the number of nodes moved, or -1 if the cursor's node has been deleted or rest isn't empty.
+int DoublyLinkedList::split_at(ListCursor& cursor, DoublyLinkedList& rest) {
+    Node* node = cursor.node;
+    if (node == NULL || cursor.list != this || &rest == this || rest.head != NULL) {
+        return -1;
+    }
+    while (!node->unlinked.load()) {
+        ListCursor last;
+        ListCursor ahead;
+        last.list = this;
+        last.node = node;
+        node->refs.fetch_add(1);
+        ahead.list = this;
+        ahead.node = node;
+        node->refs.fetch_add(1);
+        while (cursor_next(ahead)) {
+            last.release();
+            last.list = this;
+            last.node = ahead.node;
+            last.node->refs.fetch_add(1);
+        }
+        ListCursor at_head;
+        int moved = splice(cursor, last, rest, at_head);
+        if (moved >= 0 || last.node == node || !last.node->unlinked.load()) {
+            return moved;
+        }
+    }
+    return -1;
+}
+
+// Count the nodes from first to last, or return -1 if the walk runs off the end of the list before reaching last
+int DoublyLinkedList::count_range(Node* first, Node* last) {
+    int count = 0;
+    for (Node* node = first; node != NULL; node = node->next) {
+        count++;
+        if (node == last) {
+            return count;
+        }
+    }
+    return -1;
+}
+
+// Rebuild the merkle tree after nodes were moved in or out other than at the head. Like enable_merkle, this needs
+// exclusive use of the list.
+void DoublyLinkedList::regroup_merkle() {
+    if (this->merkle != NULL) {
+        int group_size = this->merkle->get_group_size();
+        delete this->merkle;
+        this->merkle = NULL;
+        enable_merkle(group_size);
+    }
+}
+
+//
+// WorkerAccounting member functions
+//
+
+WorkerAccounting::WorkerAccounting() {
+    this->reporter_stop = false;
+}
+
+WorkerAccounting::~WorkerAccounting() {
+    stop_reporter();
+    for (WorkerStats* stats : this->workers) {
+        delete stats;
+    }
+}
+
+void WorkerAccounting::register_thread(const std::string& role) {
+    WorkerStats* stats = new WorkerStats();
+    stats->role = role;
+    pthread_getcpuclockid(pthread_self(), &stats->cpu_clock);
+    stats->start = std::chrono::steady_clock::now();
+    std::lock_guard<std::mutex> lock(this->m);
+    this->workers.push_back(stats);
+    worker_stats = stats;
+}
+
+// Record the calling thread's final CPU and wall time. Its stats are kept for the dump at exit.
+void WorkerAccounting::unregister_thread() {
+    WorkerStats* stats = worker_stats;
+    if (stats == NULL) {
+        return;
+    }
+    timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    std::lock_guard<std::mutex> lock(this->m);
+    stats->cpu_ns = (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    stats->wall_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() -
+                                                                          stats->start).count();
+    stats->done = true;
+    worker_stats = NULL;
+}
+
+std::map<std::string, WorkerAccounting::RoleTotals> WorkerAccounting::collect() {
+    std::map<std::string, RoleTotals> roles;
+    std::lock_guard<std::mutex> lock(this->m);
+    auto now = std::chrono::steady_clock::now();
+    for (WorkerStats* stats : this->workers) {
+        RoleTotals& totals = roles[stats->role];
+        totals.threads++;
+        if (stats->done) {
+            totals.wall_ns += stats->wall_ns;
+            totals.cpu_ns += stats->cpu_ns;
+        }
+        else {
+            timespec ts;
+            clock_gettime(stats->cpu_clock, &ts);
+            totals.wall_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(now - stats->start).count();
+            totals.cpu_ns += (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+        }
+        totals.lock_ns += stats->lock_ns.load(std::memory_order_relaxed);
+        totals.io_ns += stats->io_ns.load(std::memory_order_relaxed);
+        totals.sleep_ns += stats->sleep_ns.load(std::memory_order_relaxed);
+        totals.ops += stats->ops.load(std::memory_order_relaxed);
+    }
+    return roles;
+}
+
+// Print the totals for each role: threads, then seconds of wall time, CPU time, time off the CPU, and time spent
+// waiting on locks, writing output and sleeping. The last three are wall time (writing output includes the CPU
+// time to format it), and a sleep in progress is only counted once it ends.
+void WorkerAccounting::dump(std::ostream& out) {
+    for (auto& entry : collect()) {
+        const RoleTotals& t = entry.second;
+        int64_t off_cpu = std::max<int64_t>(0, t.wall_ns - t.cpu_ns);
+        out << "[accounting] " << entry.first << " x" << t.threads << ": wall " << t.wall_ns / 1e9 << " s, cpu "
+            << t.cpu_ns / 1e9 << " s, off cpu " << off_cpu / 1e9 << " s, lock wait " << t.lock_ns / 1e9
+            << " s, io " << t.io_ns / 1e9 << " s, sleep " << t.sleep_ns / 1e9 << " s\n";
+    }
+    out.flush();
+}
+
+void WorkerAccounting::start_reporter(std::chrono::milliseconds interval) {
+    this->reporter = std::thread([this, interval]() {
+        std::unique_lock<std::mutex> lock(this->m);
+        while (!this->reporter_cv.wait_for(lock, interval, [this]() { return this->reporter_stop; })) {
+            lock.unlock();
+            dump(std::cerr);
+            lock.lock();
+        }
+    });
+}
+
+void WorkerAccounting::stop_reporter() {
+    if (!this->reporter.joinable()) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(this->m);
+        this->reporter_stop = true;
+    }
+    this->reporter_cv.notify_one();
+    this->reporter.join();
+}
+
+//
+// StatsRegistry member functions
+//
+
+// write end of the running reporter's pipe, for on_signal
+static volatile sig_atomic_t stats_wake_fd = -1;
+
+StatsRegistry::StatsRegistry() {
+    this->next_gauge = 0;
+    this->last_dump = std::chrono::steady_clock::now();
+    this->wake_fds[0] = -1;
+    this->wake_fds[1] = -1;
+}
+
+StatsRegistry::~StatsRegistry() {
+    stop_signal_reporter();
+}
+
+int StatsRegistry::add_gauge(const std::string& name, const std::function<double()>& read) {
+    std::lock_guard<std::mutex> lock(this->m);
+    this->gauges[this->next_gauge] = std::make_pair(name, read);
+    return this->next_gauge++;
+}
+
+void StatsRegistry::remove_gauge(int id) {
+    std::lock_guard<std::mutex> lock(this->m);
+    this->gauges.erase(id);
+}
+
+void StatsRegistry::dump(std::ostream& out) {
+    std::map<std::string, WorkerAccounting::RoleTotals> roles = worker_accounting.collect();
+    std::lock_guard<std::mutex> lock(this->m);
+    auto now = std::chrono::steady_clock::now();
+    double interval = std::chrono::duration<double>(now - this->last_dump).count();
+    this->last_dump = now;
+    for (auto& entry : this->gauges) {
+        out << "[stats] " << entry.second.first << " " << (int64_t)entry.second.second() << "\n";
+    }
+    int64_t lock_ns = 0;
+    for (auto& entry : roles) {
+        const WorkerAccounting::RoleTotals& t = entry.second;
+        int64_t& last = this->last_ops[entry.first];
+        out << "[stats] " << entry.first << " x" << t.threads << ": " << t.ops << " ops, "
+            << (interval > 0 ? (t.ops - last) / interval : 0) << " ops/s, lock wait " << t.lock_ns / 1e9 << " s\n";
+        last = t.ops;
+        lock_ns += t.lock_ns;
+    }
+    out << "[stats] lock wait total " << lock_ns / 1e9 << " s\n";
+    out.flush();
+}
+
+void StatsRegistry::on_signal(int) {
+    int saved_errno = errno;
+    char wake = 1;
+    if (stats_wake_fd >= 0) {
+        // the pipe is non-blocking: if it is full, a dump is already on its way
+        ssize_t ignored = write(stats_wake_fd, &wake, 1);
+        (void)ignored;
+    }
+    errno = saved_errno;
+}
+
+void StatsRegistry::start_signal_reporter(const std::string& path) {
+    if (this->reporter.joinable() || pipe2(this->wake_fds, O_CLOEXEC) != 0) {
+        return;
+    }
+    fcntl(this->wake_fds[1], F_SETFL, O_NONBLOCK);
+    stats_wake_fd = this->wake_fds[1];
+    this->reporter = std::thread([this, path]() {
+        char wake;
+        // a 0 byte from stop_signal_reporter ends the thread
+        while (true) {
+            ssize_t got = read(this->wake_fds[0], &wake, 1);
+            if (got < 0 && errno == EINTR) {
+                continue;
+            }
+            if (got <= 0 || wake == 0) {
+                break;
+            }
+            if (path.empty()) {
+                dump(std::cerr);
+            }
+            else {
+                std::ofstream out(path, std::ios::app);
+                dump(out);
+            }
+        }
+    });
+    struct sigaction sa;
+    std::memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGUSR1, &sa, NULL);
+}
+
+// stats_registry's gauges, for MetricsExporter
+void StatsRegistry::read_gauges(std::vector<std::pair<std::string, double>>& out) {
+    std::lock_guard<std::mutex> lock(this->m);
+    for (auto& entry : this->gauges) {
+        out.push_back(std::make_pair(entry.second.first, entry.second.second()));
+    }
+}
+
+void StatsRegistry::stop_signal_reporter() {
+    if (!this->reporter.joinable()) {
+        return;
+    }
+    signal(SIGUSR1, SIG_IGN);
+    stats_wake_fd = -1;
+    // a blocking write, so the stop can't be lost to a full pipe
+    fcntl(this->wake_fds[1], F_SETFL, 0);
+    char stop = 0;
+    ssize_t ignored = write(this->wake_fds[1], &stop, 1);
+    (void)ignored;
+    this->reporter.join();
+    close(this->wake_fds[0]);
+    close(this->wake_fds[1]);
+}
+
+//
+// MetricsExporter member functions
+//
+
+// The calling thread's metrics, handed over to the exporter's totals when the thread exits
+struct OpMetricsOwner {
+    OpMetrics* metrics = NULL;
+    ~OpMetricsOwner() {
+        if (this->metrics != NULL) {
+            metrics_exporter.retire(this->metrics);
+        }
+    }
+};
+
+static thread_local OpMetricsOwner op_metrics_owner;
+
+MetricsExporter::MetricsExporter() {
+    this->enabled = false;
+    this->exporter_stop = false;
+}
+
+MetricsExporter::~MetricsExporter() {
+    stop();
+    for (OpMetrics* metrics : this->threads) {
+        delete metrics;
+    }
+}
+
+void MetricsExporter::record(MetricOp op, int64_t ns) {
+    OpMetrics* metrics = op_metrics_owner.metrics;
+    if (metrics == NULL) {
+        metrics = new OpMetrics();
+        {
+            std::lock_guard<std::mutex> lock(this->m);
+            this->threads.push_back(metrics);
+        }
+        op_metrics_owner.metrics = metrics;
+    }
+    double seconds = ns / 1e9;
+    int bucket = 0;
+    while (bucket < metric_buckets - 1 && seconds > metric_bounds[bucket]) {
+        bucket++;
+    }
+    auto bump = [](std::atomic<uint64_t>& counter, uint64_t n) {
+        counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    };
+    bump(metrics->count[op], 1);
+    bump(metrics->sum_ns[op], (uint64_t)std::max<int64_t>(0, ns));
+    bump(metrics->buckets[op][bucket], 1);
+}
+
+void MetricsExporter::retire(OpMetrics* metrics) {
+    std::lock_guard<std::mutex> lock(this->m);
+    for (int op = 0; op < METRIC_OPS; op++) {
+        this->retired.count[op] += metrics->count[op].load();
+        this->retired.sum_ns[op] += metrics->sum_ns[op].load();
+        for (int b = 0; b < metric_buckets; b++) {
+            this->retired.buckets[op][b] += metrics->buckets[op][b].load();
+        }
+    }
+    this->threads.erase(std::find(this->threads.begin(), this->threads.end(), metrics));
+    delete metrics;
+}
+
+void MetricsExporter::write_file(const std::string& path) {
+    static const char* const op_names[METRIC_OPS] = { "insert_head", "delete_node", "traverse" };
+    uint64_t count[METRIC_OPS], sum_ns[METRIC_OPS], buckets[METRIC_OPS][metric_buckets];
+    {
+        std::lock_guard<std::mutex> lock(this->m);
+        for (int op = 0; op < METRIC_OPS; op++) {
+            count[op] = this->retired.count[op].load();
+            sum_ns[op] = this->retired.sum_ns[op].load();
+            for (int b = 0; b < metric_buckets; b++) {
+                buckets[op][b] = this->retired.buckets[op][b].load();
+            }
+            for (OpMetrics* metrics : this->threads) {
+                count[op] += metrics->count[op].load(std::memory_order_relaxed);
+                sum_ns[op] += metrics->sum_ns[op].load(std::memory_order_relaxed);
+                for (int b = 0; b < metric_buckets; b++) {
+                    buckets[op][b] += metrics->buckets[op][b].load(std::memory_order_relaxed);
+                }
+            }
+        }
+    }
+    std::vector<std::pair<std::string, double>> gauges;
+    stats_registry.read_gauges(gauges);
+
+    std::string tmp = path + ".tmp";
+    {
+        std::ofstream out(tmp, std::ios::trunc);
+        out << "# HELP dll_operations_total List operations completed.\n"
+            << "# TYPE dll_operations_total counter\n";
+        for (int op = 0; op < METRIC_OPS; op++) {
+            out << "dll_operations_total{op=\"" << op_names[op] << "\"} " << count[op] << "\n";
+        }
+        out << "# HELP dll_operation_seconds Time taken by list operations.\n"
+            << "# TYPE dll_operation_seconds histogram\n";
+        for (int op = 0; op < METRIC_OPS; op++) {
+            // buckets are cumulative in the exposition format
+            uint64_t cumulative = 0;
+            for (int b = 0; b < metric_buckets; b++) {
+                cumulative += buckets[op][b];
+                out << "dll_operation_seconds_bucket{op=\"" << op_names[op] << "\",le=\"";
+                if (b < metric_buckets - 1) {
+                    out << metric_bounds[b];
+                }
+                else {
+                    out << "+Inf";
+                }
+                out << "\"} " << cumulative << "\n";
+            }
+            out << "dll_operation_seconds_sum{op=\"" << op_names[op] << "\"} " << sum_ns[op] / 1e9 << "\n"
+                << "dll_operation_seconds_count{op=\"" << op_names[op] << "\"} " << cumulative << "\n";
+        }
+        for (auto& gauge : gauges) {
+            out << "# TYPE dll_" << gauge.first << " gauge\n"
+                << "dll_" << gauge.first << " " << gauge.second << "\n";
+        }
+        if (!out) {
+            std::cerr << "Can't write " << tmp << "\n";
+            return;
+        }
+    }
+    if (rename(tmp.c_str(), path.c_str()) != 0) {
+        std::cerr << "Can't rename " << tmp << " to " << path << ": " << std::strerror(errno) << "\n";
+    }
+}
+
+void MetricsExporter::start(const std::string& path, std::chrono::milliseconds interval) {
+    if (this->exporter.joinable()) {
+        return;
+    }
+    this->enabled = true;
+    this->exporter = std::thread([this, path, interval]() {
+        std::unique_lock<std::mutex> lock(this->m);
+        do {
+            lock.unlock();
+            write_file(path);
+            lock.lock();
+        } while (!this->exporter_cv.wait_for(lock, interval, [this]() { return this->exporter_stop; }));
+        lock.unlock();
+        // once more, so the file ends up with the final counts
+        write_file(path);
+    });
+}
+
+void MetricsExporter::stop() {
+    if (!this->exporter.joinable()) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(this->m);
+        this->exporter_stop = true;
+    }
+    this->exporter_cv.notify_one();
+    this->exporter.join();
+    this->enabled = false;
+}
+
+//
+// LockWatchdog member functions
+//
+
+// The calling thread's LockHolder, dropped from the watchdog when the thread exits
+struct LockHolderOwner {
+    LockHolder* holder = NULL;
+    ~LockHolderOwner() {
+        if (this->holder != NULL) {
+            lock_watchdog.retire(this->holder);
+        }
+    }
+};
+
+static thread_local LockHolderOwner lock_holder_owner;
+
+// A cheap monotonic timestamp (a few milliseconds' resolution is plenty for spotting stalls)
+static int64_t coarse_now_ns() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+LockWatchdog::LockWatchdog() {
+    this->enabled = false;
+    this->threshold_ns = 0;
+    this->watchdog_stop = false;
+}
+
+LockWatchdog::~LockWatchdog() {
+    stop();
+    for (LockHolder* holder : this->holders) {
+        delete holder;
+    }
+}
+
+LockHolder* LockWatchdog::holder() {
+    LockHolder* holder = lock_holder_owner.holder;
+    if (holder == NULL) {
+        holder = new LockHolder();
+        holder->role = (worker_stats != NULL) ? worker_stats->role : "unregistered";
+        holder->tid = current_tid();
+        {
+            std::lock_guard<std::mutex> lock(this->m);
+            this->holders.push_back(holder);
+        }
+        lock_holder_owner.holder = holder;
+    }
+    return holder;
+}
+
+void LockWatchdog::waiting(Node* node) {
+    LockHolder* holder = this->holder();
+    holder->waiting_since.store(coarse_now_ns(), std::memory_order_relaxed);
+    holder->waiting_for.store(node, std::memory_order_release);
+}
+
+void LockWatchdog::acquired(Node* node) {
+    LockHolder* holder = this->holder();
+    holder->waiting_for.store(NULL, std::memory_order_relaxed);
+    // a thread holding more than max_held locks at once has the rest go unwatched
+    for (int i = 0; i < LockHolder::max_held; i++) {
+        if (holder->held[i].load(std::memory_order_relaxed) == NULL) {
+            holder->held_since[i].store(coarse_now_ns(), std::memory_order_relaxed);
+            holder->held[i].store(node, std::memory_order_release);
+            return;
+        }
+    }
+}
+
+void LockWatchdog::released(Node* node) {
+    LockHolder* holder = lock_holder_owner.holder;
+    if (holder == NULL) {
+        return;
+    }
+    for (int i = 0; i < LockHolder::max_held; i++) {
+        if (holder->held[i].load(std::memory_order_relaxed) == node) {
+            holder->held[i].store(NULL, std::memory_order_release);
+            return;
+        }
+    }
+}
+
+void LockWatchdog::retire(LockHolder* holder) {
+    std::lock_guard<std::mutex> lock(this->m);
+    this->holders.erase(std::find(this->holders.begin(), this->holders.end(), holder));
+    delete holder;
+}
+
+int LockWatchdog::check(std::ostream& out) {
+    std::lock_guard<std::mutex> lock(this->m);
+    int64_t now = coarse_now_ns();
+    int found = 0;
+    // who holds each node, from this (not quite instantaneous) look at every thread
+    std::unordered_map<Node*, LockHolder*> owners;
+    for (LockHolder* holder : this->holders) {
+        for (int i = 0; i < LockHolder::max_held; i++) {
+            Node* node = holder->held[i].load(std::memory_order_acquire);
+            if (node == NULL) {
+                continue;
+            }
+            owners[node] = holder;
+            int64_t held_ns = now - holder->held_since[i].load(std::memory_order_relaxed);
+            if (held_ns > this->threshold_ns) {
+                out << "[watchdog] node " << (void*)node << " held for " << held_ns / 1e9 << " s by " << holder->role
+                    << " (tid " << holder->tid << ")\n";
+                found++;
+            }
+        }
+    }
+    // each thread waits for at most one node, and each node has one holder, so following the waits from a
+    // thread either ends or runs into a cycle. Only waits longer than the threshold count, so that a cycle
+    // pieced together from a lock that changed hands mid-look is ignored; each cycle is reported once, from its
+    // lowest-addressed thread.
+    auto next = [this, &owners, now](LockHolder* holder) -> LockHolder* {
+        Node* node = holder->waiting_for.load(std::memory_order_acquire);
+        if (node == NULL || now - holder->waiting_since.load(std::memory_order_relaxed) <= this->threshold_ns) {
+            return NULL;
+        }
+        auto it = owners.find(node);
+        return (it != owners.end()) ? it->second : NULL;
+    };
+    for (LockHolder* start : this->holders) {
+        LockHolder* holder = start;
+        bool lowest = true;
+        for (size_t steps = 0; steps < this->holders.size(); steps++) {
+            holder = next(holder);
+            if (holder == NULL || holder == start) {
+                break;
+            }
+            lowest = lowest && start < holder;
+        }
+        if (holder != start || !lowest) {
+            continue;
+        }
+        out << "[watchdog] deadlock:";
+        do {
+            out << " " << holder->role << " (tid " << holder->tid << ") waits for node "
+                << (void*)holder->waiting_for.load() << ", held by";
+            holder = next(holder);
+        } while (holder != start);
+        out << " " << start->role << " (tid " << start->tid << ")\n";
+        found++;
+    }
+    out.flush();
+    return found;
+}
+
+void LockWatchdog::start(std::chrono::milliseconds threshold) {
+    if (this->watchdog.joinable()) {
+        return;
+    }
+    this->threshold_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(threshold).count();
+    this->enabled = true;
+    this->watchdog = std::thread([this, threshold]() {
+        std::unique_lock<std::mutex> lock(this->m);
+        while (!this->watchdog_cv.wait_for(lock, threshold, [this]() { return this->watchdog_stop; })) {
+            lock.unlock();
+            check(std::cerr);
+            lock.lock();
+        }
+    });
+}
+
+void LockWatchdog::stop() {
+    if (!this->watchdog.joinable()) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(this->m);
+        this->watchdog_stop = true;
+    }
+    this->watchdog_cv.notify_one();
+    this->watchdog.join();
+    this->enabled = false;
+}
+
+//
+// StringTable member functions
+//
+
+StringTable string_table;
+
+// Only runs at exit, once every node is gone
+StringTable::~StringTable() {
+    for (Shard& shard : this->shards) {
+        for (auto& entry : shard.map) {
+            delete entry.second;
+        }
+    }
+}
+
+Payload* StringTable::intern(const std::string& str) {
+    Shard& shard = shard_for(str);
+    std::lock_guard<std::mutex> lock(shard.m);
+    this->references.fetch_add(1, std::memory_order_relaxed);
+    auto it = shard.map.find(str);
+    if (it != shard.map.end()) {
+        it->second->refs.fetch_add(1, std::memory_order_relaxed);
+        return it->second;
+    }
+    Payload* payload = new Payload();
+    payload->str = str;
+    shard.map.emplace(std::string_view(payload->str), payload);
+    this->payloads.fetch_add(1, std::memory_order_relaxed);
+    return payload;
+}
+
+Payload* StringTable::find(const std::string& str) {
+    Shard& shard = shard_for(str);
+    std::lock_guard<std::mutex> lock(shard.m);
+    auto it = shard.map.find(str);
+    if (it == shard.map.end()) {
+        return NULL;
+    }
+    this->references.fetch_add(1, std::memory_order_relaxed);
+    it->second->refs.fetch_add(1, std::memory_order_relaxed);
+    return it->second;
+}
+
+// Drop a reference, only taking the shard lock when it might be the last one
+void StringTable::release(Payload* payload) {
+    this->references.fetch_sub(1, std::memory_order_relaxed);
+    int refs = payload->refs.load(std::memory_order_relaxed);
+    while (refs > 1) {
+        if (payload->refs.compare_exchange_weak(refs, refs - 1, std::memory_order_release)) {
+            return;
+        }
+    }
+    Shard& shard = shard_for(payload->str);
+    std::lock_guard<std::mutex> lock(shard.m);
+    if (payload->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        shard.map.erase(payload->str);
+        this->payloads.fetch_sub(1, std::memory_order_relaxed);
+        delete payload;
+    }
+}
+
+// Approximate bytes used by the payloads and the table: each payload, its string's heap buffer if it is too
+// long for the small string buffer, and each map entry with its hash, next pointer and bucket
+size_t StringTable::get_memory() {
+    size_t bytes = 0;
+    for (Shard& shard : this->shards) {
+        std::lock_guard<std::mutex> lock(shard.m);
+        bytes += shard.map.bucket_count() * sizeof(void*);
+        for (auto& entry : shard.map) {
+            bytes += sizeof(Payload) + sizeof(entry) + sizeof(void*) + sizeof(size_t);
+            if (entry.second->str.capacity() > 15) {
+                bytes += entry.second->str.capacity() + 1;
+            }
+        }
+    }
+    return bytes;
+}
+
+//
+// NodeAllocator member functions
+//
+
+NodeAllocator node_allocator;
+
+// The calling thread's cache, and the batches of nodes it has freed for other threads' caches
+struct NodeCacheOwner {
+    NodeCache* cache = NULL;
+    std::unordered_map<NodeCache*, std::vector<void*>> outgoing;
+    ~NodeCacheOwner() { node_allocator.thread_exit(); }
+};
+
+static thread_local NodeCacheOwner node_cache_owner;
+// set once the calling thread's NodeCacheOwner has been destroyed, after which it mustn't be touched again
+static thread_local bool node_cache_gone = false;
+
+NodeAllocator::NodeAllocator() {
+    this->allocs = 0;
+    this->mallocs = 0;
+}
+
+// Only runs at exit, once no thread is left to use a cache
+NodeAllocator::~NodeAllocator() {
+    for (NodeCache* cache : this->caches) {
+        for (void* mem : cache->local) {
+            ::operator delete(mem);
+        }
+        for (void* mem : cache->remote) {
+            ::operator delete(mem);
+        }
+        delete cache;
+    }
+}
+
+NodeCache* NodeAllocator::thread_cache() {
+    if (node_cache_gone) {
+        return NULL;
+    }
+    if (node_cache_owner.cache == NULL) {
+        std::lock_guard<std::mutex> lock(this->m);
+        if (!this->parked.empty()) {
+            node_cache_owner.cache = this->parked.back();
+            this->parked.pop_back();
+        }
+        else {
+            node_cache_owner.cache = new NodeCache();
+            this->caches.push_back(node_cache_owner.cache);
+        }
+    }
+    return node_cache_owner.cache;
+}
+
+Node* NodeAllocator::alloc() {
+    this->allocs.fetch_add(1, std::memory_order_relaxed);
+    NodeCache* cache = thread_cache();
+    void* mem = NULL;
+    if (cache != NULL) {
+        if (cache->local.empty()) {
+            std::lock_guard<std::mutex> lock(cache->remote_m);
+            cache->local.swap(cache->remote);
+        }
+        if (!cache->local.empty()) {
+            mem = cache->local.back();
+            cache->local.pop_back();
+        }
+    }
+    if (mem == NULL) {
+        this->mallocs.fetch_add(1, std::memory_order_relaxed);
+        mem = ::operator new(sizeof(Node));
+    }
+    Node* node = new (mem) Node;
+    node->cache = cache;
+    return node;
+}
+
+void NodeAllocator::release(Node* node) {
+    NodeCache* owner = node->cache;
+    node->~Node();
+    void* mem = node;
+    if (owner == NULL) {
+        // allocated by a thread that was already exiting
+        ::operator delete(mem);
+        return;
+    }
+    NodeCache* cache = thread_cache();
+    if (cache == owner) {
+        cache->local.push_back(mem);
+    }
+    else if (cache == NULL) {
+        std::vector<void*> single(1, mem);
+        hand_back(owner, single);
+    }
+    else {
+        std::vector<void*>& batch = node_cache_owner.outgoing[owner];
+        batch.push_back(mem);
+        if (batch.size() >= batch_size) {
+            hand_back(owner, batch);
+        }
+    }
+}
+
+void NodeAllocator::hand_back(NodeCache* cache, std::vector<void*>& batch) {
+    std::lock_guard<std::mutex> lock(cache->remote_m);
+    cache->remote.insert(cache->remote.end(), batch.begin(), batch.end());
+    batch.clear();
+}
+
+void NodeAllocator::thread_exit() {
+    for (auto& entry : node_cache_owner.outgoing) {
+        hand_back(entry.first, entry.second);
+    }
+    node_cache_owner.outgoing.clear();
+    if (node_cache_owner.cache != NULL) {
+        std::lock_guard<std::mutex> lock(this->m);
+        this->parked.push_back(node_cache_owner.cache);
+        node_cache_owner.cache = NULL;
+    }
+    node_cache_gone = true;
+}
+
+//
+// EpochManager member functions
+//
+
+EpochManager node_epochs;
+
+// Frees a thread's slot when the thread exits
+struct EpochSlotOwner {
+    int slot = -1;
+    std::atomic<bool>* in_use = NULL;
+    ~EpochSlotOwner() {
+        if (this->in_use != NULL) {
+            this->in_use->store(false);
+        }
+    }
+};
+
+static thread_local EpochSlotOwner epoch_slot;
+
+EpochManager::EpochManager() {
+    this->global_epoch = 1;
+}
+
+// Everything still retired can go once no thread is left to look at it
+EpochManager::~EpochManager() {
+    for (std::pair<uint64_t, Node*>& r : this->retired) {
+        node_allocator.release(r.second);
+    }
+}
+
+int EpochManager::thread_slot() {
+    if (epoch_slot.slot < 0) {
+        for (int i = 0; i < max_threads; i++) {
+            bool expected = false;
+            if (this->slots[i].in_use.compare_exchange_strong(expected, true)) {
+                epoch_slot.slot = i;
+                epoch_slot.in_use = &this->slots[i].in_use;
+                break;
+            }
+        }
+        if (epoch_slot.slot < 0) {
+            throw std::runtime_error("too many threads for epoch reclamation");
+        }
+    }
+    return epoch_slot.slot;
+}
+
+void EpochManager::enter() {
+    Slot& slot = this->slots[thread_slot()];
+    // the announcement must be visible before the walk reads any links, hence the full fence
+    slot.epoch.store(this->global_epoch.load());
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+}
+
+void EpochManager::exit() {
+    this->slots[thread_slot()].epoch.store(0, std::memory_order_release);
+}
+
+void EpochManager::retire(Node* node) {
+    std::lock_guard<std::mutex> lock(this->retire_m);
+    this->retired.push_back(std::make_pair(this->global_epoch.load(), node));
+    if (this->retired.size() % 64 == 0) {
+        try_reclaim();
+    }
+}
+
+size_t EpochManager::get_backlog() {
+    std::lock_guard<std::mutex> lock(this->retire_m);
+    return this->retired.size();
+}
+
+// Advance the global epoch if every thread inside a guard has caught up with it, then delete whatever was
+// retired at least two epochs ago. Called with retire_m held.
+void EpochManager::try_reclaim() {
+    uint64_t epoch = this->global_epoch.load();
+    bool caught_up = true;
+    for (int i = 0; i < max_threads && caught_up; i++) {
+        uint64_t e = this->slots[i].epoch.load();
+        caught_up = (e == 0 || e == epoch);
+    }
+    if (caught_up) {
+        this->global_epoch.compare_exchange_strong(epoch, epoch + 1);
+        epoch++;
+    }
+    size_t kept = 0;
+    for (size_t i = 0; i < this->retired.size(); i++) {
+        if (this->retired[i].first + 2 <= epoch) {
+            node_allocator.release(this->retired[i].second);
+        }
+        else {
+            this->retired[kept++] = this->retired[i];
+        }
+    }
+    this->retired.resize(kept);
+}
+
+//
+// ListCursor member functions
+//
+
+// Unpin the cursor's node
+void ListCursor::release() {
+    if (this->node != NULL) {
+        this->list->unref(this->node);
+        this->node = NULL;
+    }
+}
+
+// Release a node's memory once it is unlinked and nothing can reach it through the list. If deleters walk the
+// list without locks, or readers take seqlock snapshots, one of them may still be looking at the node, so it is
+// retired to epoch reclamation.
+void DoublyLinkedList::free_node(Node* node) {
+    if (this->unlocked_walk || this->seqlock_reads) {
+        node_epochs.retire(node);
+    }
+    else {
+        node_allocator.release(node);
+    }
+}
+
+// Delete the node at the given position (counting live nodes from the head), as worker_func_2 does, but walk
+// to it without taking any locks, so the deleter doesn't hold up readers along the way. The walk runs inside an
+// epoch guard, which keeps any node it reaches allocated even if it is deleted meanwhile. Only the target and its
+// neighbours are locked, at the end, and the links are validated before unlinking; if the target was deleted
+// first the walk is retried. Requires set_unlocked_walk(true). Returns false if pos is past the end of the list.
+bool DoublyLinkedList::delete_at(int pos) {
+    OpTimer timer(METRIC_DELETE);
+    EpochGuard guard;
+    while (true) {
+        Node* node = this->head.load(std::memory_order_acquire);
+        int i = 0;
+        while (node != NULL) {
+            if (!node->unlinked.load() && !node->dead.load()) {
+                if (i == pos) {
+                    break;
+                }
+                i++;
+            }
+            node = node->next.load(std::memory_order_acquire);
+        }
+        if (node == NULL) {
+            return false;
+        }
+        if (erase_node(node)) {
+            return true;
+        }
+    }
+}
+
+// The lists the calling thread has a thread_pos entry in, whose entries are erased when the thread exits (so
+// that lists used by many short-lived threads don't keep one per thread forever)
+struct ThreadPosOwner {
+    std::vector<std::weak_ptr<ThreadPositions>> lists;
+    ~ThreadPosOwner() {
+        for (std::weak_ptr<ThreadPositions>& list : this->lists) {
+            std::shared_ptr<ThreadPositions> positions = list.lock();
+            if (positions != NULL) {
+                std::lock_guard<std::mutex> lock(positions->m);
+                positions->pos.erase(std::this_thread::get_id());
+            }
+        }
+    }
+};
+
+static thread_local ThreadPosOwner thread_pos_owner;
+
+// The current thread's entry in thread_pos. Map entries don't move, so the reference stays valid after the map's
+// mutex is released, and only this thread uses it.
+Node*& DoublyLinkedList::thread_position() {
+    std::lock_guard<std::mutex> lock(this->thread_pos->m);
+    auto entry = this->thread_pos->pos.emplace(std::this_thread::get_id(), (Node*)NULL);
+    if (entry.second) {
+        // first use of this list by this thread; forget any lists that have gone since
+        std::vector<std::weak_ptr<ThreadPositions>>& lists = thread_pos_owner.lists;
+        lists.erase(std::remove_if(lists.begin(), lists.end(),
+                                   [](const std::weak_ptr<ThreadPositions>& list) { return list.expired(); }),
+                    lists.end());
+        lists.push_back(this->thread_pos);
+    }
+    return entry.first->second;
+}
+
+// Lock/unlock a single node, firing the lock_acquire/lock_release tracepoints.
+// A lock that is already held is waited for and the wait is timed, for the lock-wait totals.
+void DoublyLinkedList::lock_node(Node* node) {
+    if (coarse_gate == this) {
+        // the list is locked as a whole
+        return;
+    }
+    bool watched = lock_watchdog.is_enabled();
+    if (!node->m.try_lock()) {
+        if (watched) {
+            lock_watchdog.waiting(node);
+        }
+        auto start = std::chrono::steady_clock::now();
+        node->m.lock();
+        int64_t waited = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() -
+                                                                              start).count();
+        this->lock_wait_ns.fetch_add((uint64_t)waited, std::memory_order_relaxed);
+        if (worker_stats != NULL) {
+            worker_stats->lock_ns.fetch_add(waited, std::memory_order_relaxed);
+        }
+        this->lock_waits.fetch_add(1, std::memory_order_relaxed);
+    }
+    if (watched) {
+        lock_watchdog.acquired(node);
+    }
+    DLL_PROBE(lock_acquire, node, current_tid(), this->length);
+}
+
+// Lock several distinct nodes without risking deadlock, the way std::lock does: block on one node and try the
+// rest, and if one of those is held, let go of everything and block on that one next
+void DoublyLinkedList::lock_nodes(const std::vector<Node*>& nodes) {
+    if (coarse_gate == this) {
+        return;
+    }
+    size_t first = 0;
+    while (true) {
+        lock_node(nodes[first]);
+        size_t failed = nodes.size();
+        for (size_t i = 0; i < nodes.size() && failed == nodes.size(); i++) {
+            if (i != first && !nodes[i]->m.try_lock()) {
+                failed = i;
+            }
+        }
+        if (failed == nodes.size()) {
+            // lock_node has already reported the first node; report the ones taken with try_lock so that
+            // every lock_release from unlock_nodes has a matching lock_acquire
+            bool watched = lock_watchdog.is_enabled();
+            for (size_t i = 0; i < nodes.size(); i++) {
+                if (i != first) {
+                    if (watched) {
+                        lock_watchdog.acquired(nodes[i]);
+                    }
+                    DLL_PROBE(lock_acquire, nodes[i], current_tid(), this->length);
+                }
+            }
+            return;
+        }
+        for (size_t i = 0; i < failed; i++) {
+            if (i != first) {
+                nodes[i]->m.unlock();
+            }
+        }
+        unlock_node(nodes[first]);
+        first = failed;
+    }
+}
+
+void DoublyLinkedList::unlock_nodes(const std::vector<Node*>& nodes) {
+    for (Node* node : nodes) {
+        unlock_node(node);
+    }
+}
+
+void DoublyLinkedList::unlock_node(Node* node) {
+    if (coarse_gate == this) {
+        return;
+    }
+    DLL_PROBE(lock_release, node, current_tid(), this->length);
+    if (lock_watchdog.is_enabled()) {
+        lock_watchdog.released(node);
+    }
+    node->m.unlock();
+}
+
+// Fire the lock tracepoints (and tell the lock watchdog) for nodes locked together with std::lock, and just
+// before they are released
+void DoublyLinkedList::probe_locked(Node* a, Node* b, Node* c) {
+    if (coarse_gate == this) {
+        return;
+    }
+    Node* nodes[] = { a, b, c };
+    bool watched = lock_watchdog.is_enabled();
+    for (Node* node : nodes) {
+        if (node != NULL) {
+            if (watched) {
+                lock_watchdog.acquired(node);
+            }
+            DLL_PROBE(lock_acquire, node, current_tid(), this->length);
+        }
+    }
+}
+
+void DoublyLinkedList::probe_unlocking(Node* a, Node* b, Node* c) {
+    if (coarse_gate == this) {
+        return;
+    }
+    Node* nodes[] = { a, b, c };
+    bool watched = lock_watchdog.is_enabled();
+    for (Node* node : nodes) {
+        if (node != NULL) {
+            DLL_PROBE(lock_release, node, current_tid(), this->length);
+            if (watched) {
+                lock_watchdog.released(node);
+            }
+        }
+    }
+}
+
+// Hooks for keeping optional per-list indexes in step with the nodes actually in the list
+void DoublyLinkedList::node_inserted(Node* node) {
+    if (this->merkle != NULL) {
+        this->merkle->on_insert_head(node);
+    }
+    if (this->bloom != NULL) {
+        this->bloom->add(node->str());
+    }
+}
+
+void DoublyLinkedList::node_removed(Node* node) {
+    if (this->log != NULL) {
+        this->log->append(MutationLog::DELETE, node->id, std::string());
+    }
+    if (this->merkle != NULL) {
+        this->merkle->on_remove(node);
+    }
+    if (this->bloom != NULL) {
+        this->bloom->remove(node->str());
+    }
+}
+
+//
+// ListMerkle member functions
+//
+
+// hashes are polynomials in merkle_base, modulo the Mersenne prime 2^61 - 1
+static const uint64_t merkle_mod = (1ULL << 61) - 1;
+static const uint64_t merkle_base = 1000003;
+
+static uint64_t mul_mod(uint64_t a, uint64_t b) {
+    unsigned __int128 product = (unsigned __int128)a * b;
+    uint64_t r = (uint64_t)(product & merkle_mod) + (uint64_t)(product >> 61);
+    return (r >= merkle_mod) ? r - merkle_mod : r;
+}
+
+static uint64_t add_mod(uint64_t a, uint64_t b) {
+    uint64_t r = a + b;
+    return (r >= merkle_mod) ? r - merkle_mod : r;
+}
+
+// Summary of the concatenation of range a followed by range b
+static ListMerkle::Summary combine(const ListMerkle::Summary& a, const ListMerkle::Summary& b) {
+    ListMerkle::Summary r;
+    r.hash = add_mod(mul_mod(a.hash, b.power), b.hash);
+    r.count = a.count + b.count;
+    r.power = mul_mod(a.power, b.power);
+    return r;
+}
+
+// FNV-1a hash of a node's string, mapped into the hash field (never 0, so empty strings still count)
+static uint64_t string_hash(const std::string& str) {
+    uint64_t h = 14695981039346656037ULL;
+    for (char c : str) {
+        h ^= (unsigned char)c;
+        h *= 1099511628211ULL;
+    }
+    return h % (merkle_mod - 1) + 1;
+}
+
+static const ListMerkle::Summary empty_summary = { 0, 0, 1 };
+
+ListMerkle::ListMerkle(int group_size) {
+    this->group_size = std::max(1, group_size);
+    this->capacity = 1;
+    this->tree.assign(2, empty_summary);
+}
+
+int ListMerkle::get_group_size() {
+    return this->group_size;
+}
+
+int ListMerkle::get_leaf_count() {
+    std::lock_guard<std::mutex> lock(this->m);
+    return (int)this->leaves.size();
+}
+
+uint64_t ListMerkle::root_hash() {
+    std::lock_guard<std::mutex> lock(this->m);
+    return this->tree[1].hash;
+}
+
+// Add a node that has just become the head of the list
+void ListMerkle::on_insert_head(Node* node) {
+    std::lock_guard<std::mutex> lock(this->m);
+    // the head-most leaf is the one opened last; open another if it is full
+    if (this->leaves.empty() || (int)this->leaves.back().items.size() >= this->group_size) {
+        if (this->leaves.size() == this->capacity) {
+            grow();
+        }
+        this->leaves.push_back(Leaf());
+    }
+    int id = (int)this->leaves.size() - 1;
+    std::vector<std::pair<Node*, uint64_t>>& items = this->leaves[id].items;
+    items.insert(items.begin(), std::make_pair(node, string_hash(node->str())));
+    this->leaf_of[node] = id;
+    update_leaf(id);
+}
+
+// Remove a node that has been unlinked from the list
+void ListMerkle::on_remove(Node* node) {
+    std::lock_guard<std::mutex> lock(this->m);
+    auto found = this->leaf_of.find(node);
+    if (found == this->leaf_of.end()) {
+        return;
+    }
+    int id = found->second;
+    this->leaf_of.erase(found);
+    std::vector<std::pair<Node*, uint64_t>>& items = this->leaves[id].items;
+    for (auto it = items.begin(); it != items.end(); ++it) {
+        if (it->first == node) {
+            items.erase(it);
+            break;
+        }
+    }
+    update_leaf(id);
+}
+
+// Recompute a leaf's summary, then the summaries on its path up to the root
+void ListMerkle::update_leaf(int id) {
+    Summary s = empty_summary;
+    for (const std::pair<Node*, uint64_t>& item : this->leaves[id].items) {
+        Summary one = { item.second, 1, merkle_base };
+        s = combine(s, one);
+    }
+    size_t i = 2 * this->capacity - 1 - id;
+    this->tree[i] = s;
+    for (i /= 2; i >= 1; i /= 2) {
+        this->tree[i] = combine(this->tree[2 * i], this->tree[2 * i + 1]);
+    }
+}
+
+// Double the number of leaf slots. Existing leaves keep their ids and end up in the right half of the tree.
+void ListMerkle::grow() {
+    size_t new_capacity = 2 * this->capacity;
+    std::vector<Summary> new_tree(2 * new_capacity, empty_summary);
+    for (size_t id = 0; id < this->leaves.size(); id++) {
+        new_tree[2 * new_capacity - 1 - id] = this->tree[2 * this->capacity - 1 - id];
+    }
+    for (size_t i = new_capacity - 1; i >= 1; i--) {
+        new_tree[i] = combine(new_tree[2 * i], new_tree[2 * i + 1]);
+    }
+    this->capacity = new_capacity;
+    this->tree.swap(new_tree);
+}
+
+// Return the ids of leaf segments whose contents differ from the other replica's, descending only into
+// subtrees whose summaries differ (so O(d log n) steps for d differing segments).
+// Replicas are expected to have been built by the same sequence of operations, so that their segments line up;
+// the root hashes can be compared regardless of segmentation.
+std::vector<int> ListMerkle::diff(ListMerkle& other) {
+    std::vector<int> out;
+    if (&other == this) {
+        return out;
+    }
+    std::unique_lock<std::mutex> lock_this(this->m, std::defer_lock);
+    std::unique_lock<std::mutex> lock_other(other.m, std::defer_lock);
+    std::lock(lock_this, lock_other);
+
+    ListMerkle* big = (this->capacity >= other.capacity) ? this : &other;
+    ListMerkle* small = (big == this) ? &other : this;
+    // a smaller tree lines up with the rightmost subtree of the bigger one, and every leaf in the bigger tree
+    // to the left of that has no counterpart at all
+    size_t i = 1;
+    size_t width = big->capacity;
+    while (width > small->capacity) {
+        big->collect_leaves(2 * i, width / 2, out);
+        i = 2 * i + 1;
+        width /= 2;
+    }
+    if (big == this) {
+        diff_subtree(other, i, 1, width, out);
+    }
+    else {
+        other.diff_subtree(*this, i, 1, width, out);
+    }
+    std::sort(out.begin(), out.end());
+    return out;
+}
+
+void ListMerkle::diff_subtree(ListMerkle& other, size_t i, size_t j, size_t width, std::vector<int>& out) {
+    const Summary& a = this->tree[i];
+    const Summary& b = other.tree[j];
+    if (a.hash == b.hash && a.count == b.count) {
+        return;
+    }
+    if (width == 1) {
+        out.push_back((int)(2 * this->capacity - 1 - i));
+        return;
+    }
+    diff_subtree(other, 2 * i, 2 * j, width / 2, out);
+    diff_subtree(other, 2 * i + 1, 2 * j + 1, width / 2, out);
+}
+
+// Add the ids of all non-empty leaves under tree node i
+void ListMerkle::collect_leaves(size_t i, size_t width, std::vector<int>& out) {
+    if (this->tree[i].count == 0) {
+        return;
+    }
+    if (width == 1) {
+        out.push_back((int)(2 * this->capacity - 1 - i));
+        return;
+    }
+    collect_leaves(2 * i, width / 2, out);
+    collect_leaves(2 * i + 1, width / 2, out);
+}
+
+//
+// PayloadBloom member functions
+//
+
+PayloadBloom::PayloadBloom(size_t cells, int hashes) : counters(std::max((size_t)1, cells)) {
+    this->hashes = std::max(1, hashes);
+}
+
+// Two independent hashes of a string: FNV-1a, and a splitmix64 finalizer of it (made odd so that successive
+// cells never coincide when the cell count is a power of two)
+void PayloadBloom::hash_pair(const std::string& str, uint64_t& h1, uint64_t& h2) {
+    uint64_t h = 14695981039346656037ULL;
+    for (char c : str) {
+        h ^= (unsigned char)c;
+        h *= 1099511628211ULL;
+    }
+    h1 = h;
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+    h2 = (h ^ (h >> 31)) | 1;
+}
+
+void PayloadBloom::add(const std::string& str) {
+    uint64_t h1, h2;
+    hash_pair(str, h1, h2);
+    for (int i = 0; i < this->hashes; i++) {
+        std::atomic<uint8_t>& counter = this->counters[cell(h1, h2, i)];
+        uint8_t c = counter.load(std::memory_order_relaxed);
+        while (c < 255 && !counter.compare_exchange_weak(c, c + 1, std::memory_order_relaxed)) {
+        }
+    }
+}
+
+void PayloadBloom::remove(const std::string& str) {
+    uint64_t h1, h2;
+    hash_pair(str, h1, h2);
+    for (int i = 0; i < this->hashes; i++) {
+        std::atomic<uint8_t>& counter = this->counters[cell(h1, h2, i)];
+        uint8_t c = counter.load(std::memory_order_relaxed);
+        while (c > 0 && c < 255 && !counter.compare_exchange_weak(c, c - 1, std::memory_order_relaxed)) {
+        }
+    }
+}
+
+bool PayloadBloom::maybe_contains(const std::string& str) {
+    uint64_t h1, h2;
+    hash_pair(str, h1, h2);
+    for (int i = 0; i < this->hashes; i++) {
+        if (this->counters[cell(h1, h2, i)].load(std::memory_order_relaxed) == 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// (1 - e^(-kn/m))^k for k hashes, n strings and m counters
+double PayloadBloom::expected_fp_rate(size_t n) {
+    double k = this->hashes;
+    return std::pow(1 - std::exp(-k * (double)n / (double)this->counters.size()), k);
+}
+
+static uint64_t segment_first_node();
+
+// Header of a PersistentList file. Only head (and the next links from it) is trusted on recovery; everything
+// else about the list is rebuilt from the chain.
+struct PersistentHeader {
+    uint64_t magic;
+    uint64_t capacity;
+    uint64_t head;
+    // node slots below this have been handed out at some point, so recovery only looks at those
+    uint64_t used;
+};
+
+// A node of a PersistentList, linked by file offsets like a SegmentNode. prev is only kept up to date while
+// the list is open, and rebuilt on recovery.
+struct PersistentNode {
+    uint64_t next;
+    uint64_t prev;
+    char data[16];
+};
+
+// Doubly linked list whose nodes live in a memory-mapped file, so that it survives restarts and is usable again
+// as soon as it has been reopened. Updates are made crash-consistent by ordering: an inserted node is written
+// and flushed (msync) before the store to head that makes it reachable is made and flushed, and a deleted
+// node's unlink is flushed before its slot can be reused. Each link is a single aligned 8-byte store, so the
+// next-chain from head is always a valid list, and recovery rebuilds the prev links, free slots and length
+// from it in one pass over the used slots. Node locks live in memory, not in the file, and are taken as in
+// SegmentList.
+class PersistentList {
+public:
+    // open the list in path, recovering it if the file exists, or create it with room for capacity nodes
+    PersistentList(const std::string& path, uint64_t capacity);
+    ~PersistentList();
+    // with durable off, updates are not flushed, so they survive a crash of the process but not of the machine
+    void set_durable(bool on) { this->durable = on; }
+    // flush the whole file, e.g. after a batch of updates made with durable off
+    void sync();
+    int get_length() { return (int)this->length.load(); }
+    bool insert_head(const std::string& data);
+    const char* get_head_str(SegmentCursor& cursor);
+    const char* get_next_str(SegmentCursor& cursor);
+    void delete_node(SegmentCursor& cursor);
+    bool was_recovered() { return this->recovered; }
+    double get_recovery_seconds() { return this->recovery_seconds; }
+    // number of flushes made, for measuring the cost of durability
+    long get_flushes() { return this->flushes.load(); }
+
+private:
+    void recover();
+    void flush(void* addr, size_t len);
+    uint64_t slot_of(uint64_t offset) { return (offset - segment_first_node()) / sizeof(PersistentNode); }
+    PersistentNode* node_at(uint64_t offset) { return (offset == 0) ? NULL : (PersistentNode*)(this->base + offset); }
+    uint64_t offset_of(PersistentNode* node) {
+        return (node == NULL) ? 0 : (uint64_t)((char*)node - this->base);
+    }
+    std::mutex* lock_of(PersistentNode* node) {
+        return (node == NULL) ? NULL : &this->locks[slot_of(offset_of(node))];
+    }
+
+    std::string path;
+    char* base;
+    size_t size;
+    PersistentHeader* header;
+    bool durable;
+    bool recovered;
+    double recovery_seconds;
+    std::atomic<long> flushes;
+    std::atomic<int64_t> length;
+    std::unique_ptr<std::mutex[]> locks;
+    // set (under the node's lock) once a node has been deleted, until its slot is reused
+    std::unique_ptr<std::atomic<bool>[]> unlinked;
+    // guards header->head
+    std::mutex head_m;
+    // guards free_slots and header->used
+    std::mutex alloc_m;
+    std::vector<uint64_t> free_slots;
+};
+
+//
+// SegmentList member functions
+//
+
+static const uint64_t segment_magic = 0x646c6c7365676d31ULL;
+
+// offset of the first node, after the header
+static uint64_t segment_first_node() {
+    return (sizeof(SegmentHeader) + 63) / 64 * 64;
+}
+
+// Take over a robust mutex whose owner died holding it, or fail if it can't be used any more. The lock is marked
+// consistent and kept, so the list stays usable. Only locking is protected this way: a process killed in the
+// middle of an insert or delete can still leave the links it was changing half-updated.
+static int recover_shared_mutex(pthread_mutex_t* m, int err) {
+    if (err == EOWNERDEAD) {
+        pthread_mutex_consistent(m);
+        return 0;
+    }
+    if (err != 0 && err != EBUSY) {
+        throw std::runtime_error(std::string("pthread_mutex_lock: ") + std::strerror(err));
+    }
+    return err;
+}
+
+static void lock_shared_mutex(pthread_mutex_t* m) {
+    recover_shared_mutex(m, pthread_mutex_lock(m));
+}
+
+// Lockable wrapper around a pthread mutex, so process-shared mutexes can be used with std::lock.
+// A NULL mutex is ignored.
+struct PosixMutexRef {
+    pthread_mutex_t* m;
+    void lock() {
+        if (m != NULL) {
+            lock_shared_mutex(m);
+        }
+    }
+    bool try_lock() { return m == NULL || recover_shared_mutex(m, pthread_mutex_trylock(m)) == 0; }
+    void unlock() {
+        if (m != NULL) {
+            pthread_mutex_unlock(m);
+        }
+    }
+};
+
+static void init_shared_mutex(pthread_mutex_t* m) {
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(m, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+SegmentList::SegmentList(const std::string& name, uint64_t capacity) {
+    this->name = name;
+    int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd < 0) {
+        throw std::runtime_error("shm_open " + name + ": " + std::strerror(errno));
+    }
+    size_t size = segment_first_node() + capacity * sizeof(SegmentNode);
+    if (ftruncate(fd, (off_t)size) != 0) {
+        close(fd);
+        shm_unlink(name.c_str());
+        throw std::runtime_error("ftruncate " + name + ": " + std::strerror(errno));
+    }
+    map_segment(fd, size);
+
+    // the segment starts zeroed, so only the header fields and mutexes need setting up
+    this->header->capacity = capacity;
+    this->header->head.store(0);
+    this->header->length.store(0);
+    init_shared_mutex(&this->header->head_m);
+    init_shared_mutex(&this->header->alloc_m);
+    this->header->free_list = 0;
+    this->header->used = 0;
+    for (uint64_t i = 0; i < capacity; i++) {
+        SegmentNode* node = (SegmentNode*)(this->base + segment_first_node() + i * sizeof(SegmentNode));
+        init_shared_mutex(&node->m);
+    }
+    // publish the header last, so a process opening the segment early can tell it isn't ready
+    std::atomic_thread_fence(std::memory_order_release);
+    this->header->magic = segment_magic;
+}
+
+SegmentList::SegmentList(const std::string& name) {
+    this->name = name;
+    int fd = shm_open(name.c_str(), O_RDWR, 0600);
+    if (fd < 0) {
+        throw std::runtime_error("shm_open " + name + ": " + std::strerror(errno));
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < segment_first_node()) {
+        close(fd);
+        throw std::runtime_error("segment " + name + " is not initialized");
+    }
+    map_segment(fd, (size_t)st.st_size);
+    if (this->header->magic != segment_magic) {
+        munmap(this->base, this->size);
+        throw std::runtime_error("segment " + name + " is not a list segment");
+    }
+    std::atomic_thread_fence(std::memory_order_acquire);
+}
+
+SegmentList::~SegmentList() {
+    munmap(this->base, this->size);
+}
+
+void SegmentList::map_segment(int fd, size_t size) {
+    void* addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        throw std::runtime_error("mmap " + this->name + ": " + std::strerror(errno));
+    }
+    this->base = (char*)addr;
+    this->size = size;
+    this->header = (SegmentHeader*)addr;
+}
+
+// Remove the segment's name; processes that already have it mapped keep using it
+void SegmentList::unlink() {
+    shm_unlink(this->name.c_str());
+}
+
+// Insert a new node at the head of the list. Returns false if the segment is full. The new node is locked until
+// it is linked in, and head_m keeps a deleter from unlinking the old head while it is being relinked.
+bool SegmentList::insert_head(const std::string& data) {
+    SegmentNode* node;
+    lock_shared_mutex(&this->header->alloc_m);
+    if (this->header->free_list != 0) {
+        node = node_at(this->header->free_list);
+        this->header->free_list = node->free_next;
+    }
+    else if (this->header->used < this->header->capacity) {
+        node = (SegmentNode*)(this->base + segment_first_node() + this->header->used * sizeof(SegmentNode));
+        this->header->used++;
+    }
+    else {
+        pthread_mutex_unlock(&this->header->alloc_m);
+        return false;
+    }
+    pthread_mutex_unlock(&this->header->alloc_m);
+
+    lock_shared_mutex(&node->m);
+    node->unlinked = false;
+    std::strncpy(node->data, data.c_str(), sizeof(node->data) - 1);
+    node->data[sizeof(node->data) - 1] = '\0';
+    node->prev = 0;
+    lock_shared_mutex(&this->header->head_m);
+    uint64_t old_head = this->header->head.load();
+    node->next = old_head;
+    if (old_head != 0) {
+        node_at(old_head)->prev = offset_of(node);
+    }
+    this->header->head.store(offset_of(node), std::memory_order_release);
+    pthread_mutex_unlock(&this->header->head_m);
+    pthread_mutex_unlock(&node->m);
+    this->header->length++;
+    return true;
+}
+
+// Point the cursor at (and lock) the head node, and return its string.
+// Strings are returned in place in the segment and stay valid until the cursor next moves.
+// Returns NULL if the list is empty.
+const char* SegmentList::get_head_str(SegmentCursor& cursor) {
+    while (true) {
+        SegmentNode* head = node_at(this->header->head.load(std::memory_order_acquire));
+        if (head == NULL) {
+            cursor.pos = 0;
+            return NULL;
+        }
+        lock_shared_mutex(&head->m);
+        // the head may have been deleted (or a node inserted before it) while we waited for its lock
+        if (this->header->head.load(std::memory_order_acquire) == offset_of(head)) {
+            cursor.pos = offset_of(head);
+            return head->data;
+        }
+        pthread_mutex_unlock(&head->m);
+    }
+}
+
+// Move the cursor to the next node using hand-over-hand locking, and return its string.
+// Returns NULL (and releases the last node) once the end of the list is reached.
+const char* SegmentList::get_next_str(SegmentCursor& cursor) {
+    SegmentNode* current_node = node_at(cursor.pos);
+    if (current_node == NULL) {
+        return NULL;
+    }
+    SegmentNode* next_node = node_at(current_node->next);
+    if (next_node != NULL) {
+        lock_shared_mutex(&next_node->m);
+        cursor.pos = offset_of(next_node);
+        pthread_mutex_unlock(&current_node->m);
+        return next_node->data;
+    }
+    cursor.pos = 0;
+    pthread_mutex_unlock(&current_node->m);
+    return NULL;
+}
+
+// Delete the node at the cursor, locking it together with its neighbours (retrying if they changed while it was
+// unlocked, as in PersistentList::delete_node), and return it to the free list
+void SegmentList::delete_node(SegmentCursor& cursor) {
+    SegmentNode* current_node = node_at(cursor.pos);
+    if (current_node == NULL) {
+        return;
+    }
+    cursor.pos = 0;
+    // release lock on current node to prevent deadlock when locking below
+    pthread_mutex_unlock(&current_node->m);
+    while (true) {
+        SegmentNode* next_node = node_at(current_node->next);
+        SegmentNode* prev_node = node_at(current_node->prev);
+
+        // use synchronised locking with dependent nodes, as in DoublyLinkedList::delete_node
+        PosixMutexRef lock_prev = { (prev_node != NULL) ? &prev_node->m : NULL };
+        PosixMutexRef lock_this = { &current_node->m };
+        PosixMutexRef lock_next = { (next_node != NULL) ? &next_node->m : NULL };
+        if (next_node == NULL && prev_node == NULL) {
+            lock_this.lock();
+        }
+        else if (next_node == NULL) {
+            std::lock(lock_prev, lock_this);
+        }
+        else if (prev_node == NULL) {
+            std::lock(lock_this, lock_next);
+        }
+        else {
+            std::lock(lock_prev, lock_this, lock_next);
+        }
+        lock_shared_mutex(&this->header->head_m);
+
+        bool removed = current_node->unlinked;
+        bool unchanged = !removed && current_node->prev == offset_of(prev_node) &&
+                         current_node->next == offset_of(next_node) &&
+                         (prev_node != NULL ? prev_node->next == offset_of(current_node)
+                                            : this->header->head.load() == offset_of(current_node));
+        if (unchanged) {
+            if (prev_node != NULL) {
+                prev_node->next = offset_of(next_node);
+            }
+            else {
+                this->header->head.store(offset_of(next_node), std::memory_order_release);
+            }
+            if (next_node != NULL) {
+                next_node->prev = offset_of(prev_node);
+            }
+            current_node->unlinked = true;
+        }
+        pthread_mutex_unlock(&this->header->head_m);
+        lock_prev.unlock();
+        lock_this.unlock();
+        lock_next.unlock();
+        if (removed) {
+            // another process deleted it first
+            return;
+        }
+        if (unchanged) {
+            break;
+        }
+    }
+    this->header->length--;
+
+    lock_shared_mutex(&this->header->alloc_m);
+    current_node->free_next = this->header->free_list;
+    this->header->free_list = offset_of(current_node);
+    pthread_mutex_unlock(&this->header->alloc_m);
+}
+
+//
+// PersistentList member functions
+//
+
+static const uint64_t persistent_magic = 0x646c6c7065727331ULL;
+
+PersistentList::PersistentList(const std::string& path, uint64_t capacity) {
+    this->path = path;
+    this->durable = true;
+    this->recovered = false;
+    this->recovery_seconds = 0;
+    this->flushes = 0;
+    this->length = 0;
+    int fd = open(path.c_str(), O_RDWR | O_CREAT, 0600);
+    if (fd < 0) {
+        throw std::runtime_error("open " + path + ": " + std::strerror(errno));
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        throw std::runtime_error("fstat " + path + ": " + std::strerror(errno));
+    }
+    bool existing = st.st_size > 0;
+    size_t size = existing ? (size_t)st.st_size : segment_first_node() + capacity * sizeof(PersistentNode);
+    if (!existing && (ftruncate(fd, (off_t)size) != 0 || fsync(fd) != 0)) {
+        close(fd);
+        throw std::runtime_error("ftruncate " + path + ": " + std::strerror(errno));
+    }
+    void* addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        throw std::runtime_error("mmap " + path + ": " + std::strerror(errno));
+    }
+    this->base = (char*)addr;
+    this->size = size;
+    this->header = (PersistentHeader*)addr;
+
+    if (!existing) {
+        // the file starts zeroed, so an empty list only needs its header; magic goes last, so a file that was
+        // never fully set up is rejected rather than recovered
+        this->header->capacity = capacity;
+        this->header->head = 0;
+        this->header->used = 0;
+        flush(this->header, sizeof(PersistentHeader));
+        this->header->magic = persistent_magic;
+        flush(this->header, sizeof(PersistentHeader));
+    }
+    else if (this->header->magic != persistent_magic ||
+             size < segment_first_node() + this->header->capacity * sizeof(PersistentNode)) {
+        munmap(this->base, this->size);
+        throw std::runtime_error(path + " is not a persistent list");
+    }
+    this->locks.reset(new std::mutex[this->header->capacity]);
+    this->unlinked.reset(new std::atomic<bool>[this->header->capacity]());
+    if (existing) {
+        recover();
+    }
+}
+
+PersistentList::~PersistentList() {
+    munmap(this->base, this->size);
+}
+
+// Write the pages covering [addr, addr + len) back to the file and wait for them to reach the disk
+void PersistentList::flush(void* addr, size_t len) {
+    if (!this->durable) {
+        return;
+    }
+    static const uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+    uintptr_t start = (uintptr_t)addr & ~(page - 1);
+    uintptr_t end = (uintptr_t)addr + len;
+    msync((void*)start, end - start, MS_SYNC);
+    this->flushes++;
+}
+
+void PersistentList::sync() {
+    msync(this->base, this->size, MS_SYNC);
+    this->flushes++;
+}
+
+// Walk the next-chain from head, checking each link, and rebuild prev links, the length and the free slots.
+// A link that can't be valid (out of range, to a slot never handed out, or back to a node already seen) can only
+// come from a damaged file; the chain is cut there so the rest of the list can still be used.
+void PersistentList::recover() {
+    auto start = std::chrono::steady_clock::now();
+    uint64_t used = std::min(this->header->used, this->header->capacity);
+    std::vector<bool> linked(used, false);
+    int64_t count = 0;
+    uint64_t prev = 0;
+    uint64_t* link = &this->header->head;
+    while (*link != 0) {
+        uint64_t offset = *link;
+        bool valid = offset >= segment_first_node() && (offset - segment_first_node()) % sizeof(PersistentNode) == 0 &&
+                     slot_of(offset) < used && !linked[slot_of(offset)];
+        if (!valid) {
+            std::cerr << this->path << ": bad link to offset " << offset << " after " << count
+                      << " nodes, cutting the list there\n";
+            *link = 0;
+            flush(link, sizeof(uint64_t));
+            break;
+        }
+        linked[slot_of(offset)] = true;
+        PersistentNode* node = node_at(offset);
+        node->prev = prev;
+        prev = offset;
+        link = &node->next;
+        count++;
+    }
+    for (uint64_t slot = used; slot > 0; slot--) {
+        if (!linked[slot - 1]) {
+            this->free_slots.push_back(slot - 1);
+        }
+    }
+    this->header->used = used;
+    this->length = count;
+    this->recovered = true;
+    this->recovery_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Insert a new node at the head of the list. Returns false if the file is full.
+bool PersistentList::insert_head(const std::string& data) {
+    uint64_t slot;
+    {
+        std::lock_guard<std::mutex> lock(this->alloc_m);
+        if (!this->free_slots.empty()) {
+            slot = this->free_slots.back();
+            this->free_slots.pop_back();
+        }
+        else if (this->header->used < this->header->capacity) {
+            slot = this->header->used++;
+            flush(&this->header->used, sizeof(uint64_t));
+        }
+        else {
+            return false;
+        }
+    }
+    PersistentNode* node = (PersistentNode*)(this->base + segment_first_node() + slot * sizeof(PersistentNode));
+    std::lock_guard<std::mutex> lock_node(*lock_of(node));
+    this->unlinked[slot].store(false);
+    std::strncpy(node->data, data.c_str(), sizeof(node->data) - 1);
+    node->data[sizeof(node->data) - 1] = '\0';
+    node->prev = 0;
+    std::lock_guard<std::mutex> lock_head(this->head_m);
+    node->next = this->header->head;
+    // commit point: the node must be on disk before anything on disk links to it
+    flush(node, sizeof(PersistentNode));
+    PersistentNode* old_head = node_at(this->header->head);
+    __atomic_store_n(&this->header->head, offset_of(node), __ATOMIC_RELEASE);
+    flush(&this->header->head, sizeof(uint64_t));
+    if (old_head != NULL) {
+        old_head->prev = offset_of(node);
+    }
+    this->length++;
+    return true;
+}
+
+// Point the cursor at (and lock) the head node, and return its string, which stays valid until the cursor next
+// moves. Returns NULL if the list is empty.
+const char* PersistentList::get_head_str(SegmentCursor& cursor) {
+    while (true) {
+        PersistentNode* head = node_at(__atomic_load_n(&this->header->head, __ATOMIC_ACQUIRE));
+        if (head == NULL) {
+            cursor.pos = 0;
+            return NULL;
+        }
+        lock_of(head)->lock();
+        // the head may have been deleted while we waited for its lock
+        if (__atomic_load_n(&this->header->head, __ATOMIC_ACQUIRE) == offset_of(head)) {
+            cursor.pos = offset_of(head);
+            return head->data;
+        }
+        lock_of(head)->unlock();
+    }
+}
+
+// Move the cursor to the next node using hand-over-hand locking, and return its string.
+// Returns NULL (and releases the last node) once the end of the list is reached.
+const char* PersistentList::get_next_str(SegmentCursor& cursor) {
+    PersistentNode* current_node = node_at(cursor.pos);
+    if (current_node == NULL) {
+        return NULL;
+    }
+    PersistentNode* next_node = node_at(current_node->next);
+    if (next_node != NULL) {
+        lock_of(next_node)->lock();
+        cursor.pos = offset_of(next_node);
+        lock_of(current_node)->unlock();
+        return next_node->data;
+    }
+    cursor.pos = 0;
+    lock_of(current_node)->unlock();
+    return NULL;
+}
+
+// Delete the node at the cursor, locking it together with its neighbours (retrying if they changed while it
+// was unlocked), and only free its slot once the unlink is on disk
+void PersistentList::delete_node(SegmentCursor& cursor) {
+    PersistentNode* current_node = node_at(cursor.pos);
+    if (current_node == NULL) {
+        return;
+    }
+    cursor.pos = 0;
+    // release lock on current node to prevent deadlock when locking below
+    lock_of(current_node)->unlock();
+    while (true) {
+        PersistentNode* prev_node = node_at(current_node->prev);
+        PersistentNode* next_node = node_at(current_node->next);
+        std::unique_lock<std::mutex> lock_this(*lock_of(current_node), std::defer_lock);
+        std::unique_lock<std::mutex> lock_prev;
+        std::unique_lock<std::mutex> lock_next;
+        if (prev_node != NULL) {
+            lock_prev = std::unique_lock<std::mutex>(*lock_of(prev_node), std::defer_lock);
+        }
+        if (next_node != NULL) {
+            lock_next = std::unique_lock<std::mutex>(*lock_of(next_node), std::defer_lock);
+        }
+        if (prev_node != NULL && next_node != NULL) {
+            std::lock(lock_prev, lock_this, lock_next);
+        }
+        else if (prev_node != NULL) {
+            std::lock(lock_prev, lock_this);
+        }
+        else if (next_node != NULL) {
+            std::lock(lock_this, lock_next);
+        }
+        else {
+            lock_this.lock();
+        }
+        std::unique_lock<std::mutex> lock_head(this->head_m);
+        if (this->unlinked[slot_of(offset_of(current_node))].load()) {
+            // another thread deleted it first
+            return;
+        }
+        bool unchanged = current_node->prev == offset_of(prev_node) && current_node->next == offset_of(next_node) &&
+                         (prev_node != NULL ? prev_node->next == offset_of(current_node)
+                                            : this->header->head == offset_of(current_node));
+        if (!unchanged) {
+            continue;
+        }
+        // commit point: the unlink must be on disk before the slot can be reused
+        if (prev_node != NULL) {
+            __atomic_store_n(&prev_node->next, offset_of(next_node), __ATOMIC_RELEASE);
+            flush(&prev_node->next, sizeof(uint64_t));
+        }
+        else {
+            __atomic_store_n(&this->header->head, offset_of(next_node), __ATOMIC_RELEASE);
+            flush(&this->header->head, sizeof(uint64_t));
+        }
+        if (next_node != NULL) {
+            next_node->prev = offset_of(prev_node);
+        }
+        this->unlinked[slot_of(offset_of(current_node))].store(true);
+        break;
+    }
+    this->length--;
+    std::lock_guard<std::mutex> lock(this->alloc_m);
+    this->free_slots.push_back(slot_of(offset_of(current_node)));
+}
+
+//
+// Command queue: producers queue list mutations on a lock-free queue instead of taking node locks themselves,
+// and a single applier thread drains the queue and makes the changes, so it is the only thread mutating the
+// list while readers keep traversing it concurrently.
+//
+
+struct ListCommand {
+    enum Kind { INSERT, DELETE };
+    std::atomic<ListCommand*> next;
+    Kind kind;
+    std::string data;
+    // position to delete, taken modulo the list length when the command is applied
+    int pos;
+};
+
+// Intrusive multi-producer/single-consumer queue (Vyukov's). push is a single atomic exchange plus a store,
+// so producers never wait for each other or for the consumer. pop may only be called by the one consumer.
+class CommandQueue {
+public:
+    CommandQueue();
+    void push(ListCommand* cmd);
+    ListCommand* pop();
+
+private:
+    std::atomic<ListCommand*> tail;
+    ListCommand* head;
+    ListCommand stub;
+};
+
+CommandQueue::CommandQueue() {
+    this->stub.next = NULL;
+    this->head = &this->stub;
+    this->tail = &this->stub;
+}
+
+void CommandQueue::push(ListCommand* cmd) {
+    cmd->next.store(NULL, std::memory_order_relaxed);
+    ListCommand* prev = this->tail.exchange(cmd, std::memory_order_acq_rel);
+    prev->next.store(cmd, std::memory_order_release);
+}
+
+// Take the oldest command off the queue. Returns NULL if the queue is empty, or if the only command is
+// still being pushed (its producer has swapped tail but not yet linked it in).
+ListCommand* CommandQueue::pop() {
+    ListCommand* first = this->head;
+    ListCommand* next = first->next.load(std::memory_order_acquire);
+    if (first == &this->stub) {
+        if (next == NULL) {
+            return NULL;
+        }
+        this->head = next;
+        first = next;
+        next = next->next.load(std::memory_order_acquire);
+    }
+    if (next != NULL) {
+        this->head = next;
+        return first;
+    }
+    if (first != this->tail.load(std::memory_order_acquire)) {
+        return NULL;
+    }
+    // first is the last command: put the stub back behind it so it can be taken off
+    push(&this->stub);
+    next = first->next.load(std::memory_order_acquire);
+    if (next != NULL) {
+        this->head = next;
+        return first;
+    }
+    return NULL;
+}
+
+static void delete_at_position(DoublyLinkedList& dll, int pos);
+
+// Owns the applier thread, which applies queued commands to a list until stopped
+class CommandApplier {
+public:
+    CommandApplier(DoublyLinkedList& dll);
+    ~CommandApplier();
+    void submit_insert(const std::string& data);
+    void submit_delete(int pos);
+    long get_depth() { return this->submitted.load() - this->applied.load(); }
+    long get_applied() { return this->applied.load(); }
+
+private:
+    void apply_loop();
+
+    DoublyLinkedList& dll;
+    CommandQueue queue;
+    std::atomic<long> submitted;
+    std::atomic<long> applied;
+    std::atomic<bool> stopping;
+    std::thread applier;
+};
+
+CommandApplier::CommandApplier(DoublyLinkedList& dll) : dll(dll) {
+    this->submitted = 0;
+    this->applied = 0;
+    this->stopping = false;
+    this->applier = std::thread(&CommandApplier::apply_loop, this);
+}
+
+// Stop once everything already submitted has been applied
+CommandApplier::~CommandApplier() {
+    this->stopping = true;
+    this->applier.join();
+}
+
+void CommandApplier::submit_insert(const std::string& data) {
+    ListCommand* cmd = new ListCommand();
+    cmd->kind = ListCommand::INSERT;
+    cmd->data = data;
+    this->submitted.fetch_add(1, std::memory_order_relaxed);
+    this->queue.push(cmd);
+}
+
+void CommandApplier::submit_delete(int pos) {
+    ListCommand* cmd = new ListCommand();
+    cmd->kind = ListCommand::DELETE;
+    cmd->pos = pos;
+    this->submitted.fetch_add(1, std::memory_order_relaxed);
+    this->queue.push(cmd);
+}
+
+void CommandApplier::apply_loop() {
+    int idle = 0;
+    while (true) {
+        ListCommand* cmd = this->queue.pop();
+        if (cmd == NULL) {
+            if (this->stopping && get_depth() == 0) {
+                break;
+            }
+            // spin briefly to catch the next burst, then back off
+            if (++idle < 100) {
+                std::this_thread::yield();
+            }
+            else {
+                std::this_thread::sleep_for(std::chrono::microseconds(50));
+            }
+            continue;
+        }
+        idle = 0;
+        if (cmd->kind == ListCommand::INSERT) {
+            this->dll.insert_head(cmd->data);
+        }
+        else if (this->dll.get_length() > 0) {
+            delete_at_position(this->dll, cmd->pos % this->dll.get_length());
+        }
+        delete cmd;
+        this->applied.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+//
+// SimClock: the clock the workers' sleeps (and anything rate limited) go through.
+// In virtual mode a sleep doesn't block: the sleeping thread's clock is moved forward instead, so a scenario
+// that is mostly sleeping runs as fast as the CPU allows while still tracking how long it would have taken.
+// Each thread's clock reads real elapsed time plus the sleeps it has skipped, and the scenario's projected
+// wall-clock time is the furthest any thread's clock has got. Since the clocks are per thread, readings taken on
+// different threads can't be compared, so nothing that measures other threads' progress (the elastic pool's
+// controller) can run on virtual time.
+//
+
+class SimClock {
+public:
+    SimClock();
+    void set_virtual(bool on) { this->virtual_time = on; }
+    bool is_virtual() { return this->virtual_time; }
+    std::chrono::nanoseconds now();
+    void sleep_for(std::chrono::nanoseconds duration);
+    std::chrono::nanoseconds elapsed();
+
+private:
+    bool virtual_time;
+    std::chrono::steady_clock::time_point start;
+    // furthest any thread's clock has reached, in nanoseconds
+    std::atomic<int64_t> furthest;
+};
+
+// time skipped by the calling thread's virtual sleeps
+static thread_local int64_t skipped_ns = 0;
+
+SimClock sim_clock;
+
+SimClock::SimClock() {
+    this->virtual_time = false;
+    this->start = std::chrono::steady_clock::now();
+    this->furthest = 0;
+}
+
+// Time since the clock started, as seen by the calling thread
+std::chrono::nanoseconds SimClock::now() {
+    return std::chrono::steady_clock::now() - this->start + std::chrono::nanoseconds(skipped_ns);
+}
+
+void SimClock::sleep_for(std::chrono::nanoseconds duration) {
+    if (!this->virtual_time) {
+        AccountedTime sleeping(&WorkerStats::sleep_ns);
+        std::this_thread::sleep_for(duration);
+        return;
+    }
+    skipped_ns += duration.count();
+    int64_t t = now().count();
+    int64_t seen = this->furthest.load();
+    while (t > seen && !this->furthest.compare_exchange_weak(seen, t)) {
+    }
+}
+
+// How long the scenario would have taken so far in real time
+std::chrono::nanoseconds SimClock::elapsed() {
+    int64_t real = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() -
+                                                                        this->start).count();
+    return std::chrono::nanoseconds(std::max(real, this->furthest.load()));
+}
+
+//
+// Elastic worker pool: instead of main's fixed pair of workers, a controller thread samples the deletion
+// and traversal rates, lock-wait time and list length, and spawns or retires reader and deleter workers at
+// runtime to hold a target deletion rate without readers spending their time waiting on node locks.
+// Deleters use delete_at, which is safe with any number of them, so the list is put in unlocked-walk mode.
+//
+
+class WorkerPool {
+public:
+    WorkerPool(DoublyLinkedList& dll, double target_rate, int max_readers, int max_deleters);
+    void run();
+
+private:
+    enum Role { READER, DELETER };
+    struct Worker {
+        Role role;
+        std::atomic<bool> stop{ false };
+        // lets a reader being retired abandon its traversal
+        CancelToken cancel;
+        std::thread thread;
+    };
+    void spawn(Role role);
+    void retire(Role role);
+    int count(Role role);
+    void reader_loop(Worker* worker);
+    void deleter_loop(Worker* worker, unsigned int seed);
+
+    DoublyLinkedList& dll;
+    double target_rate;
+    int max_readers;
+    int max_deleters;
+    std::vector<Worker*> workers;
+    std::atomic<long> traversals;
+    std::atomic<long> deletions;
+};
+
+WorkerPool::WorkerPool(DoublyLinkedList& dll, double target_rate, int max_readers, int max_deleters)
+    : dll(dll) {
+    this->target_rate = target_rate;
+    this->max_readers = std::max(1, max_readers);
+    this->max_deleters = std::max(1, max_deleters);
+    this->traversals = 0;
+    this->deletions = 0;
+}
+
+// Start with one worker of each kind and adjust them every sampling interval until the list is empty
+void WorkerPool::run() {
+    this->dll.set_unlocked_walk(true);
+    spawn(READER);
+    spawn(DELETER);
+    const auto interval = std::chrono::milliseconds(1000);
+    long last_traversals = 0;
+    long last_deletions = 0;
+    uint64_t last_wait_ns = this->dll.get_lock_wait_ns();
+    auto last = sim_clock.now();
+    while (this->dll.get_length() > 0) {
+        sim_clock.sleep_for(interval);
+        auto now = sim_clock.now();
+        double secs = std::chrono::duration<double>(now - last).count();
+        long t = this->traversals.load();
+        long d = this->deletions.load();
+        uint64_t wait_ns = this->dll.get_lock_wait_ns();
+        double traversal_rate = (double)(t - last_traversals) / secs;
+        double deletion_rate = (double)(d - last_deletions) / secs;
+        // share of the workers' time spent waiting for node locks
+        int readers = count(READER);
+        int deleters = count(DELETER);
+        double wait_share = (double)(wait_ns - last_wait_ns) / 1e9 / secs / (readers + deleters);
+        int length = this->dll.get_length();
+        last = now;
+        last_traversals = t;
+        last_deletions = d;
+        last_wait_ns = wait_ns;
+
+        std::string decision = "hold";
+        if (deletion_rate < 0.9 * this->target_rate && deleters < this->max_deleters && deleters < length) {
+            spawn(DELETER);
+            decision = "spawn deleter";
+        }
+        else if ((deletion_rate > 1.1 * this->target_rate || deleters > length) && deleters > 1) {
+            retire(DELETER);
+            decision = "retire deleter";
+        }
+        else if (wait_share > 0.2 && readers > 1) {
+            retire(READER);
+            decision = "retire reader";
+        }
+        else if (wait_share < 0.05 && readers < this->max_readers) {
+            spawn(READER);
+            decision = "spawn reader";
+        }
+        std::cout << "[pool] t=" << std::chrono::duration<double>(now).count() << "s length=" << length
+                  << " readers=" << readers << " deleters=" << deleters << " traversals/s=" << traversal_rate
+                  << " deletions/s=" << deletion_rate << " lock wait=" << wait_share * 100 << "% -> " << decision
+                  << "\n";
+    }
+    for (Worker* worker : this->workers) {
+        worker->stop = true;
+    }
+    for (Worker* worker : this->workers) {
+        worker->thread.join();
+        delete worker;
+    }
+    this->workers.clear();
+    std::cout << "[pool] list empty after " << this->traversals << " traversals and " << this->deletions
+              << " deletions\n";
+}
+
+void WorkerPool::spawn(Role role) {
+    Worker* worker = new Worker();
+    worker->role = role;
+    if (role == READER) {
+        worker->thread = std::thread(&WorkerPool::reader_loop, this, worker);
+    }
+    else {
+        worker->thread = std::thread(&WorkerPool::deleter_loop, this, worker, (unsigned int)std::rand());
+    }
+    this->workers.push_back(worker);
+}
+
+// Stop the most recently spawned worker of the given role and wait for it to finish
+void WorkerPool::retire(Role role) {
+    for (auto it = this->workers.rbegin(); it != this->workers.rend(); ++it) {
+        if ((*it)->role == role) {
+            Worker* worker = *it;
+            this->workers.erase(std::next(it).base());
+            worker->stop = true;
+            worker->cancel.cancel();
+            worker->thread.join();
+            delete worker;
+            return;
+        }
+    }
+}
+
+int WorkerPool::count(Role role) {
+    int n = 0;
+    for (Worker* worker : this->workers) {
+        n += (worker->role == role) ? 1 : 0;
+    }
+    return n;
+}
+
+// record a pool worker's operation, if the run is being recorded (see TraceRecorder)
+static void record_traversal(uint32_t visited);
+static void record_deletion(uint32_t pos);
+
+// worker_func_1's traversal, without printing. Traversals go through a cursor, so that retiring the reader
+// cancels the one in progress rather than waiting for it to finish; only finished traversals are recorded.
+void WorkerPool::reader_loop(Worker* worker) {
+    WorkerScope scope("reader");
+    while (!worker->stop && this->dll.get_length() > 0) {
+        std::string concatenated;
+        uint32_t visited = 0;
+        ListCursor cursor;
+        OpTimer timer(METRIC_TRAVERSE);
+        TraverseResult result = this->dll.traverse(
+            cursor,
+            [&concatenated, &visited](const std::string& s) {
+                concatenated += s;
+                visited++;
+            },
+            std::chrono::steady_clock::time_point::max(), &worker->cancel);
+        if (result == TRAVERSE_DONE) {
+            count_ops();
+            record_traversal(visited);
+            this->traversals++;
+        }
+    }
+}
+
+// worker_func_2's deletion, using delete_at
+void WorkerPool::deleter_loop(Worker* worker, unsigned int seed) {
+    WorkerScope scope("deleter");
+    while (!worker->stop && this->dll.get_length() > 0) {
+        int length = this->dll.get_length();
+        int pos = (length > 0) ? (int)(rand_r(&seed) % length) : 0;
+        if (length > 0 && this->dll.delete_at(pos)) {
+            this->dll.commit();
+            count_ops();
+            record_deletion((uint32_t)pos);
+            this->deletions++;
+        }
+        sim_clock.sleep_for(std::chrono::milliseconds(500));
+    }
+}
+
+//
+// MutationLog member functions
+//
+
+// A record is a checksum (over the rest of the record), the kind, the node id, the string's length and the string
+static const size_t log_record_header = 4 + 1 + 8 + 4;
+
+MutationLog::MutationLog(const std::string& path, std::chrono::microseconds commit_delay) {
+    this->fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0600);
+    if (this->fd < 0) {
+        throw std::runtime_error("open " + path + ": " + std::strerror(errno));
+    }
+    // make the truncation durable before anything is appended, so a crash can't leave old records under new ones
+    if (fdatasync(this->fd) != 0) {
+        int saved_errno = errno;
+        close(this->fd);
+        throw std::runtime_error("fdatasync " + path + ": " + std::strerror(saved_errno));
+    }
+    this->commit_delay = commit_delay;
+    this->buffered_records = 0;
+    this->appended = 0;
+    this->durable = 0;
+    this->syncing = false;
+    this->syncs = 0;
+    this->synced_records = 0;
+}
+
+MutationLog::~MutationLog() {
+    commit();
+    close(this->fd);
+}
+
+// Add a record to the buffer; it isn't written out until some thread commits
+void MutationLog::append(Kind kind, uint64_t id, const std::string& data) {
+    std::string record(log_record_header, '\0');
+    uint32_t length = (uint32_t)data.size();
+    record[4] = (char)kind;
+    std::memcpy(&record[5], &id, sizeof(id));
+    std::memcpy(&record[13], &length, sizeof(length));
+    record += data;
+    uint32_t checksum = (uint32_t)string_hash(record.substr(4));
+    std::memcpy(&record[0], &checksum, sizeof(checksum));
+
+    std::lock_guard<std::mutex> lock(this->m);
+    this->buffer += record;
+    this->buffered_records++;
+    this->appended += record.size();
+}
+
+// Wait until every record appended before this call is on disk. If another thread is already syncing, wait for
+// it: its sync may cover our records, and if not, the next leader's will. Otherwise this thread leads, writing out
+// and syncing everything buffered so far (including the records of any threads waiting on it) in one go.
+void MutationLog::commit() {
+    std::unique_lock<std::mutex> lock(this->m);
+    uint64_t target = this->appended;
+    while (this->durable < target) {
+        if (this->syncing) {
+            this->synced.wait(lock);
+            continue;
+        }
+        this->syncing = true;
+        if (this->commit_delay.count() > 0) {
+            // let other committers add their records to this group
+            lock.unlock();
+            std::this_thread::sleep_for(this->commit_delay);
+            lock.lock();
+        }
+        std::string out;
+        out.swap(this->buffer);
+        long records = this->buffered_records;
+        this->buffered_records = 0;
+        uint64_t end = this->appended;
+        lock.unlock();
+
+        {
+            AccountedTime io(&WorkerStats::io_ns);
+            size_t done = 0;
+            while (done < out.size()) {
+                ssize_t n = write(this->fd, out.data() + done, out.size() - done);
+                if (n < 0 && errno != EINTR) {
+                    throw std::runtime_error(std::string("log write: ") + std::strerror(errno));
+                }
+                done += (n > 0) ? (size_t)n : 0;
+            }
+            if (fdatasync(this->fd) != 0) {
+                throw std::runtime_error(std::string("log fdatasync: ") + std::strerror(errno));
+            }
+        }
+        this->syncs++;
+        this->synced_records += records;
+
+        lock.lock();
+        this->durable = end;
+        this->syncing = false;
+        this->synced.notify_all();
+    }
+}
+
+long MutationLog::replay(const std::string& path,
+                         const std::function<void(Kind kind, uint64_t id, const std::string& data)>& apply) {
+    std::ifstream in(path, std::ios::binary);
+    std::string header(log_record_header, '\0');
+    long count = 0;
+    while (in.read(&header[0], (std::streamsize)header.size())) {
+        uint32_t checksum;
+        uint64_t id;
+        uint32_t length;
+        std::memcpy(&checksum, &header[0], sizeof(checksum));
+        std::memcpy(&id, &header[5], sizeof(id));
+        std::memcpy(&length, &header[13], sizeof(length));
+        if (length > (1u << 24)) {
+            break;
+        }
+        std::string data(length, '\0');
+        if (!in.read(&data[0], (std::streamsize)length)) {
+            break;
+        }
+        Kind kind = (Kind)header[4];
+        if ((uint32_t)string_hash(header.substr(4) + data) != checksum || (kind != INSERT && kind != DELETE)) {
+            break;
+        }
+        apply(kind, id, data);
+        count++;
+    }
+    return count;
+}
+
+void MutationLog::sync_dir(const std::string& path) {
+    size_t slash = path.rfind('/');
+    std::string dir = (slash == std::string::npos) ? "." : (slash == 0 ? "/" : path.substr(0, slash));
+    int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+    if (fd < 0) {
+        throw std::runtime_error("open " + dir + ": " + std::strerror(errno));
+    }
+    int result = fsync(fd);
+    int saved_errno = errno;
+    close(fd);
+    if (result != 0) {
+        throw std::runtime_error("fsync " + dir + ": " + std::strerror(saved_errno));
+    }
+}
+
+//
+// Operation traces: every insert, delete and traversal made by the workers is recorded (with the thread that
+// made it and when) so that a run can be replayed deterministically, or its per-thread operation streams
+// replayed concurrently against a differently configured list.
+//
+// A trace file starts with trace_magic and the random seed, followed by TraceRecords in the order the
+// operations completed. Each record is written field by field (trace_record_size bytes, with no padding), and an
+// insert record is followed by its string (len bytes).
+//
+
+enum TraceOp : uint8_t {
+    TRACE_INSERT = 1,
+    TRACE_DELETE = 2,
+    TRACE_TRAVERSE = 3,
+};
+
+struct TraceRecord {
+    // nanoseconds since recording started
+    uint64_t time_ns;
+    uint8_t op;
+    // index of the recording thread, in order of first appearance. The elastic pool starts a new thread each
+    // time it grows, so a long run can see many more than 256.
+    uint32_t thread;
+    // length of the string following an insert record
+    uint16_t len;
+    // position deleted, or number of nodes visited by a traversal
+    uint32_t arg;
+};
+
+static const size_t trace_record_size = 8 + 1 + 4 + 2 + 4;
+
+static void encode_trace_record(const TraceRecord& rec, char* out) {
+    std::memcpy(out, &rec.time_ns, 8);
+    std::memcpy(out + 8, &rec.op, 1);
+    std::memcpy(out + 9, &rec.thread, 4);
+    std::memcpy(out + 13, &rec.len, 2);
+    std::memcpy(out + 15, &rec.arg, 4);
+}
+
+static void decode_trace_record(const char* in, TraceRecord& rec) {
+    std::memcpy(&rec.time_ns, in, 8);
+    std::memcpy(&rec.op, in + 8, 1);
+    std::memcpy(&rec.thread, in + 9, 4);
+    std::memcpy(&rec.len, in + 13, 2);
+    std::memcpy(&rec.arg, in + 15, 4);
+}
+
+struct TraceEntry {
+    TraceRecord rec;
+    std::string data;
+};
+
+static const char trace_magic[8] = { 'D', 'L', 'L', 'T', 'R', 'A', 'C', '3' };
+
+class TraceRecorder {
+public:
+    TraceRecorder(const std::string& path, unsigned int seed);
+    ~TraceRecorder();
+    void record(TraceOp op, uint32_t arg, const std::string& data = std::string());
+
+private:
+    void flush();
+
+    std::ofstream out;
+    std::chrono::steady_clock::time_point start;
+    std::map<std::thread::id, uint32_t> threads;
+    std::vector<char> buf;
+    std::mutex m;
+};
+
+// set while the workers' operations are being recorded
+TraceRecorder* trace_recorder = NULL;
+
+TraceRecorder::TraceRecorder(const std::string& path, unsigned int seed) {
+    this->out.open(path, std::ios::binary | std::ios::trunc);
+    if (!this->out) {
+        throw std::runtime_error("can't write trace file " + path);
+    }
+    this->out.write(trace_magic, sizeof(trace_magic));
+    uint32_t seed32 = seed;
+    this->out.write((const char*)&seed32, sizeof(seed32));
+    this->start = std::chrono::steady_clock::now();
+}
+
+TraceRecorder::~TraceRecorder() {
+    flush();
+}
+
+// Append a record to the in-memory buffer, writing the buffer out once it gets large
+void TraceRecorder::record(TraceOp op, uint32_t arg, const std::string& data) {
+    TraceRecord rec;
+    rec.op = op;
+    rec.arg = arg;
+    rec.len = (uint16_t)std::min(data.size(), (size_t)UINT16_MAX);
+    std::lock_guard<std::mutex> lock(this->m);
+    rec.time_ns = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+                      std::chrono::steady_clock::now() - this->start).count();
+    auto found = this->threads.find(std::this_thread::get_id());
+    if (found == this->threads.end()) {
+        found = this->threads.emplace(std::this_thread::get_id(), (uint32_t)this->threads.size()).first;
+    }
+    rec.thread = found->second;
+    char bytes[trace_record_size];
+    encode_trace_record(rec, bytes);
+    this->buf.insert(this->buf.end(), bytes, bytes + trace_record_size);
+    this->buf.insert(this->buf.end(), data.data(), data.data() + rec.len);
+    if (this->buf.size() >= (1 << 20)) {
+        flush();
+    }
+}
+
+void TraceRecorder::flush() {
+    this->out.write(this->buf.data(), (std::streamsize)this->buf.size());
+    this->out.flush();
+    this->buf.clear();
+}
+
+static void record_traversal(uint32_t visited) {
+    if (trace_recorder != NULL) {
+        trace_recorder->record(TRACE_TRAVERSE, visited);
+    }
+}
+
+static void record_deletion(uint32_t pos) {
+    if (trace_recorder != NULL) {
+        trace_recorder->record(TRACE_DELETE, pos);
+    }
+}
+
+// Read a whole trace file. Returns false if it can't be read or isn't a trace.
+static bool read_trace(const std::string& path, unsigned int& seed, std::vector<TraceEntry>& entries) {
+    std::ifstream in(path, std::ios::binary);
+    char magic[sizeof(trace_magic)];
+    uint32_t seed32;
+    if (!in.read(magic, sizeof(magic)) || std::memcmp(magic, trace_magic, sizeof(magic)) != 0 ||
+        !in.read((char*)&seed32, sizeof(seed32))) {
+        return false;
+    }
+    seed = seed32;
+    TraceEntry entry;
+    char bytes[trace_record_size];
+    while (in.read(bytes, sizeof(bytes))) {
+        decode_trace_record(bytes, entry.rec);
+        entry.data.resize(entry.rec.len);
+        if (entry.rec.len > 0 && !in.read(&entry.data[0], entry.rec.len)) {
+            return false;
+        }
+        entries.push_back(entry);
+    }
+    return true;
+}
+
+// Replay trace entries against a list at full speed, on the calling thread.
+// List can be any list type with DoublyLinkedList's interface. Deletes past the end of the list (which
+// can happen when a thread's stream is replayed out of step with the others) wrap around, and are made as
+// worker_func_2 makes them (with delete_at if the list has unlocked walks on).
+template <typename List>
+static void replay_entries(const std::vector<const TraceEntry*>& entries, List& dll) {
+    for (const TraceEntry* entry : entries) {
+        switch (entry->rec.op) {
+        case TRACE_INSERT:
+            dll.insert_head(entry->data);
+            break;
+        case TRACE_DELETE: {
+            int length = dll.get_length();
+            if (length > 0) {
+                int pos = (int)(entry->rec.arg % (uint32_t)length);
+                if (dll.get_unlocked_walk()) {
+                    dll.delete_at(pos);
+                    break;
+                }
+                dll.get_head_str();
+                for (int i = 0; i < pos; i++) {
+                    dll.get_next_str();
+                }
+                dll.delete_node();
+            }
+            break;
+        }
+        case TRACE_TRAVERSE: {
+            std::string concatenated;
+            std::string current = dll.get_head_str();
+            while (!current.empty()) {
+                concatenated += current;
+                current = dll.get_next_str();
+            }
+            break;
+        }
+        }
+    }
+}
+
+// random string generator declaration
+std::string get_random_str();
+
+void worker_func_1(DoublyLinkedList& dll, std::chrono::microseconds slice);
+void worker_func_2(DoublyLinkedList& dll);
+int sort_bench(int argc, char* argv[]);
+int merkle_demo(int argc, char* argv[]);
+int shm_demo(int argc, char* argv[]);
+int serve(int argc, char* argv[]);
+int loadgen(int argc, char* argv[]);
+int replay(int argc, char* argv[]);
+int queue_bench(int argc, char* argv[]);
+int cursor_bench(int argc, char* argv[]);
+int bloom_demo(int argc, char* argv[]);
+int intern_demo(int argc, char* argv[]);
+int persist_demo(int argc, char* argv[]);
+int wal_bench(int argc, char* argv[]);
+int adaptive_bench(int argc, char* argv[]);
+int self_test(int argc, char* argv[]);
+static double seconds_since(std::chrono::steady_clock::time_point start);
+static void print_node_allocs();
+
+int main(int argc, char* argv[]) {
+    // optional benchmark/demo modes, selected by the first argument
+    if (argc > 1 && argv[1][0] != '-') {
+        std::string mode = argv[1];
+        if (mode == "sort-bench") {
+            return sort_bench(argc - 2, argv + 2);
+        }
+        if (mode == "merkle-demo") {
+            return merkle_demo(argc - 2, argv + 2);
+        }
+        if (mode == "shm-demo") {
+            return shm_demo(argc - 2, argv + 2);
+        }
+        if (mode == "serve") {
+            return serve(argc - 2, argv + 2);
+        }
+        if (mode == "loadgen") {
+            return loadgen(argc - 2, argv + 2);
+        }
+        if (mode == "replay") {
+            return replay(argc - 2, argv + 2);
+        }
+        if (mode == "queue-bench") {
+            return queue_bench(argc - 2, argv + 2);
+        }
+        if (mode == "cursor-bench") {
+            return cursor_bench(argc - 2, argv + 2);
+        }
+        if (mode == "bloom-demo") {
+            return bloom_demo(argc - 2, argv + 2);
+        }
+        if (mode == "intern-demo") {
+            return intern_demo(argc - 2, argv + 2);
+        }
+        if (mode == "persist-demo") {
+            return persist_demo(argc - 2, argv + 2);
+        }
+        if (mode == "wal-bench") {
+            return wal_bench(argc - 2, argv + 2);
+        }
+        if (mode == "adaptive-bench") {
+            return adaptive_bench(argc - 2, argv + 2);
+        }
+        if (mode == "self-test") {
+            return self_test(argc - 2, argv + 2);
+        }
+        std::cerr << "Unknown mode: " << mode << "\n";
+        return 1;
+    }
+
+    // options for the default run
+    // cast time_t to unsigned int for random seed, to prevent warning
+    unsigned int seed = (unsigned int)std::time(NULL);
+    std::string record_path;
+    std::string wal_path;
+    std::string stats_path;
+    std::string metrics_path;
+    long watchdog_ms = 0;
+    LockGranularity granularity = GRANULARITY_FINE;
+    int total_nodes = 140;
+    bool lazy_delete = false;
+    bool unlocked_walk = false;
+    double target_rate = 0;
+    double accounting_interval = 0;
+    bool seqlock_reads = false;
+    std::chrono::microseconds slice(0);
+    for (int i = 1; i < argc; i++) {
+        std::string opt = argv[i];
+        if (opt == "--seed" && i + 1 < argc) {
+            seed = (unsigned int)std::strtoul(argv[++i], NULL, 10);
+        }
+        else if (opt == "--record" && i + 1 < argc) {
+            record_path = argv[++i];
+        }
+        else if (opt == "--nodes" && i + 1 < argc) {
+            total_nodes = std::atoi(argv[++i]);
+        }
+        else if (opt == "--virtual-time") {
+            sim_clock.set_virtual(true);
+        }
+        else if (opt == "--lazy-delete") {
+            lazy_delete = true;
+        }
+        else if (opt == "--unlocked-walk") {
+            unlocked_walk = true;
+        }
+        else if (opt == "--elastic" && i + 1 < argc) {
+            target_rate = std::atof(argv[++i]);
+        }
+        else if (opt == "--slice" && i + 1 < argc) {
+            slice = std::chrono::microseconds((long)(std::atof(argv[++i]) * 1000));
+        }
+        else if (opt == "--seqlock") {
+            seqlock_reads = true;
+        }
+        else if (opt == "--accounting" && i + 1 < argc) {
+            accounting_interval = std::atof(argv[++i]);
+        }
+        else if (opt == "--wal" && i + 1 < argc) {
+            wal_path = argv[++i];
+        }
+        else if (opt == "--stats" && i + 1 < argc) {
+            stats_path = argv[++i];
+        }
+        else if (opt == "--metrics" && i + 1 < argc) {
+            metrics_path = argv[++i];
+        }
+        else if (opt == "--watchdog" && i + 1 < argc) {
+            watchdog_ms = std::atol(argv[++i]);
+        }
+        else if (opt == "--granularity" && i + 1 < argc) {
+            std::string name = argv[++i];
+            if (name == "coarse") {
+                granularity = GRANULARITY_COARSE;
+            }
+            else if (name == "adaptive") {
+                granularity = GRANULARITY_ADAPTIVE;
+            }
+            else if (name != "fine") {
+                std::cerr << "Unknown granularity: " << name << "\n";
+                return 1;
+            }
+        }
+        else {
+            std::cerr << "Unknown option: " << opt << "\n";
+            return 1;
+        }
+    }
+    if (granularity != GRANULARITY_FINE && (lazy_delete || unlocked_walk || seqlock_reads || target_rate > 0)) {
+        // these go around the locks (the elastic pool deletes with unlocked walks)
+        std::cerr << "--granularity coarse/adaptive can't be used with lazy deletion, unlocked walks, seqlock reads "
+                     "or --elastic\n";
+        return 1;
+    }
+    if (sim_clock.is_virtual() && target_rate > 0) {
+        // each thread's virtual clock runs on from its own skipped sleeps, so the controller's rate
+        // measurements would mix readings from clocks that disagree
+        std::cerr << "--virtual-time can't be used with --elastic\n";
+        return 1;
+    }
+    std::srand(seed);
+    if (!record_path.empty()) {
+        trace_recorder = new TraceRecorder(record_path, seed);
+    }
+
+    // initialize doubly linked list to start with 140 nodes (by default)
+    DoublyLinkedList dll;
+    if (!metrics_path.empty()) {
+        metrics_exporter.start(metrics_path, std::chrono::seconds(1));
+    }
+    auto start = std::chrono::steady_clock::now();
+    if (!wal_path.empty() && dll.recover(wal_path) && dll.get_length() > 0) {
+        // carry on from where the last run with this log left off
+        std::cout << "Recovered " << dll.get_length() << " nodes from " << wal_path << "\n";
+    }
+    else {
+        for (int i = 0; i < total_nodes; i++) {
+            std::string data = get_random_str();
+            dll.insert_head(data);
+            if (trace_recorder != NULL) {
+                trace_recorder->record(TRACE_INSERT, 0, data);
+            }
+        }
+    }
+    if (!wal_path.empty()) {
+        dll.attach_log(wal_path);
+    }
+
+    dll.set_lazy_delete(lazy_delete);
+    dll.set_unlocked_walk(unlocked_walk);
+    dll.set_seqlock_reads(seqlock_reads);
+    dll.set_granularity(granularity);
+    if (accounting_interval > 0) {
+        worker_accounting.start_reporter(std::chrono::milliseconds((long)(accounting_interval * 1000)));
+    }
+    std::vector<int> gauges;
+    if (!stats_path.empty() || !metrics_path.empty()) {
+        gauges.push_back(stats_registry.add_gauge("list_length", [&dll]() { return dll.get_length(); }));
+        gauges.push_back(
+            stats_registry.add_gauge("node_bytes", [&dll]() { return (double)dll.get_length() * sizeof(Node); }));
+        gauges.push_back(stats_registry.add_gauge("string_bytes", []() { return string_table.get_memory(); }));
+        gauges.push_back(
+            stats_registry.add_gauge("reclamation_backlog", []() { return node_epochs.get_backlog(); }));
+    }
+    if (!stats_path.empty()) {
+        stats_registry.start_signal_reporter(stats_path == "-" ? "" : stats_path);
+    }
+    if (watchdog_ms > 0) {
+        lock_watchdog.start(std::chrono::milliseconds(watchdog_ms));
+    }
+
+    if (target_rate > 0) {
+        // let the elastic pool decide how many workers to run
+        WorkerPool pool(dll, target_rate, 4, 16);
+        pool.run();
+    }
+    else {
+        // start worker threads and wait until completion (for all nodes to be deleted)
+        std::thread t1(worker_func_1, std::ref(dll), slice);
+        std::thread t2(worker_func_2, std::ref(dll));
+        t1.join();
+        t2.join();
+    }
+    if (accounting_interval > 0) {
+        worker_accounting.stop_reporter();
+        worker_accounting.dump(std::cerr);
+    }
+    lock_watchdog.stop();
+    metrics_exporter.stop();
+    stats_registry.stop_signal_reporter();
+    for (int id : gauges) {
+        stats_registry.remove_gauge(id);
+    }
+    if (seqlock_reads) {
+        std::cout << "Seqlock reads: " << dll.get_optimistic_reads() << " optimistic, " << dll.get_fallback_reads()
+                  << " fell back to node locks\n";
+    }
+
+    if (sim_clock.is_virtual()) {
+        std::cout << "Virtual time: " << std::chrono::duration<double>(sim_clock.elapsed()).count()
+                  << " s projected wall-clock time, ran in " << seconds_since(start) << " s\n";
+    }
+    delete trace_recorder;
+    trace_recorder = NULL;
+    return 0;
+}
+
+// Return a random string of chars in {a-z} with length (3, 9)
+std::string get_random_str() {
+    int str_len = rand() % 7 + 3;
+    std::string random_str;
+    for (int i = 0; i < str_len; i++) {
+        // pick a random char a-z
+        char tmp = 'a' + rand() % 26;
+        random_str.push_back(tmp);
+    }
+    return random_str;
+}
+
+// First worker thread - repeat: concatenate data from all nodes in list and print out at the end of the list
+void worker_func_1(DoublyLinkedList& dll, std::chrono::microseconds slice) {
+    WorkerScope scope("reader");
+    while (dll.get_length() > 0) {
+        std::string concatenated;
+        uint32_t visited = 0;
+        OpTimer timer(METRIC_TRAVERSE);
+        if (slice.count() > 0) {
+            // traverse in slices of at most slice, letting go of the list in between
+            ListCursor cursor;
+            auto append = [&concatenated, &visited](const std::string& s) {
+                concatenated += s;
+                visited++;
+            };
+            while (dll.traverse(cursor, append, std::chrono::steady_clock::now() + slice) != TRAVERSE_DONE) {
+                std::this_thread::yield();
+            }
+        }
+        else if (dll.get_seqlock_reads()) {
+            // copy the strings out without node locks where possible
+            std::vector<std::string> strings;
+            dll.snapshot(strings);
+            for (const std::string& s : strings) {
+                concatenated += s;
+            }
+            visited = (uint32_t)strings.size();
+        }
+        else {
+            // initialize thread position and point
+            std::string current = dll.get_head_str();
+            // check for empty string to indicate when end of list has been reached
+            while (!current.empty()) {
+                concatenated += current;
+                visited++;
+                current = dll.get_next_str();
+            }
+        }
+        timer.stop();
+        count_ops();
+        if (trace_recorder != NULL) {
+            trace_recorder->record(TRACE_TRAVERSE, visited);
+        }
+        AccountedTime io(&WorkerStats::io_ns);
+        std::cout << "\nConcatenated thread: " << concatenated << "\n";
+    }
+    std::cout << "List empty: worker 1 stopping\n";
+}
+
+// Worker thread 2 - choose a node at random to delete from list, sleep for 500ms and repeat
+void worker_func_2(DoublyLinkedList& dll) {
+    WorkerScope scope("deleter");
+    while (dll.get_length() > 0) {
+        // choose a node to delete from the list at random
+        int pos_to_delete = rand() % dll.get_length();
+
+        if (dll.get_unlocked_walk()) {
+            // walk to the target without locks, and only lock around it to delete it
+            dll.delete_at(pos_to_delete);
+        }
+        else {
+            // initialize thread position and point to first node
+            std::string tmp = dll.get_head_str();
+            for (int i = 0; i < pos_to_delete; i++) {
+                // use this to iterate over nodes until we reach the target node
+                tmp = dll.get_next_str();
+            }
+            // delete the node at the current target position
+            dll.delete_node();
+        }
+        // with a log attached, wait for the deletion to be on disk
+        dll.commit();
+        count_ops();
+        if (trace_recorder != NULL) {
+            trace_recorder->record(TRACE_DELETE, (uint32_t)pos_to_delete);
+        }
+
+        sim_clock.sleep_for(std::chrono::milliseconds(500));
+    }
+    std::cout << "List empty: worker 2 stopping\n";
+}
+
+// Fill a list with random strings from the given seed, so that benchmark runs can build identical lists
+static void fill_random(DoublyLinkedList& dll, int total_nodes, unsigned int seed) {
+    std::srand(seed);
+    for (int i = 0; i < total_nodes; i++) {
+        dll.insert_head(get_random_str());
+    }
+}
+
+// Check that a list is in sorted order by walking it from the head
+static bool is_sorted(DoublyLinkedList& dll) {
+    std::string prev = dll.get_head_str();
+    std::string current = prev;
+    while (!current.empty()) {
+        if (current < prev) {
+            // finish the traversal so the thread doesn't keep a node locked
+            while (!current.empty()) {
+                current = dll.get_next_str();
+            }
+            return false;
+        }
+        prev = current;
+        current = dll.get_next_str();
+    }
+    return true;
+}
+
+static double seconds_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Compare the in-place parallel sort with the copy-out approach (copy all strings into a vector, sort it,
+// then rebuild the list from it). Usage: sort-bench [nodes] [threads]
+int sort_bench(int argc, char* argv[]) {
+    int total_nodes = (argc > 0) ? std::atoi(argv[0]) : 1000000;
+    unsigned int num_threads = (argc > 1) ? (unsigned int)std::atoi(argv[1]) : 0;
+    if (num_threads == 0) {
+        num_threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    unsigned int seed = (unsigned int)std::time(NULL);
+    std::cout << "Sorting " << total_nodes << " nodes\n";
+
+    // copy-out: the vector of strings and the rebuilt list both exist alongside the original list
+    {
+        DoublyLinkedList* original = new DoublyLinkedList;
+        fill_random(*original, total_nodes, seed);
+        auto start = std::chrono::steady_clock::now();
+        std::vector<std::string> values;
+        values.reserve(original->get_length());
+        std::string current = original->get_head_str();
+        while (!current.empty()) {
+            values.push_back(current);
+            current = original->get_next_str();
+        }
+        std::sort(values.begin(), values.end());
+        DoublyLinkedList* rebuilt = new DoublyLinkedList;
+        for (auto it = values.rbegin(); it != values.rend(); ++it) {
+            rebuilt->insert_head(*it);
+        }
+        delete original;
+        double secs = seconds_since(start);
+        double extra_mb = (double)values.size() * (sizeof(std::string) + sizeof(Node)) / (1024 * 1024);
+        std::cout << "copy-out:           " << secs << " s, ~" << extra_mb << " MB extra, sorted: "
+                  << (is_sorted(*rebuilt) ? "yes" : "no") << "\n";
+        delete rebuilt;
+    }
+
+    // in-place on one thread, then on the requested number of threads
+    unsigned int thread_counts[] = { 1, num_threads };
+    for (unsigned int threads : thread_counts) {
+        DoublyLinkedList dll;
+        fill_random(dll, total_nodes, seed);
+        auto start = std::chrono::steady_clock::now();
+        dll.sort(threads);
+        double secs = seconds_since(start);
+        std::cout << "in-place, " << threads << " thread(s): " << secs << " s, no payload copies, sorted: "
+                  << (is_sorted(dll) ? "yes" : "no") << "\n";
+        if (num_threads == 1) {
+            break;
+        }
+    }
+    return 0;
+}
+
+// Delete the node at the given position, walking to it the same way as worker_func_2
+static void delete_at_position(DoublyLinkedList& dll, int pos) {
+    dll.get_head_str();
+    for (int i = 0; i < pos; i++) {
+        dll.get_next_str();
+    }
+    dll.delete_node();
+}
+
+// Build two replicas of a list from the same seed, delete a few nodes from one of them and use the
+// merkle trees to find which segments differ. Usage: merkle-demo [nodes] [group_size] [deletions]
+int merkle_demo(int argc, char* argv[]) {
+    int total_nodes = (argc > 0) ? std::atoi(argv[0]) : 100000;
+    int group_size = (argc > 1) ? std::atoi(argv[1]) : 16;
+    int deletions = (argc > 2) ? std::atoi(argv[2]) : 3;
+    unsigned int seed = (unsigned int)std::time(NULL);
+
+    DoublyLinkedList replica_a;
+    DoublyLinkedList replica_b;
+    replica_a.enable_merkle(group_size);
+    replica_b.enable_merkle(group_size);
+    fill_random(replica_a, total_nodes, seed);
+    fill_random(replica_b, total_nodes, seed);
+    std::cout << "Replicas of " << total_nodes << " nodes in " << replica_a.get_merkle()->get_leaf_count()
+              << " segments, root hashes " << replica_a.get_merkle()->root_hash() << " / "
+              << replica_b.get_merkle()->root_hash() << "\n";
+
+    for (int i = 0; i < deletions && replica_b.get_length() > 0; i++) {
+        int pos = std::rand() % replica_b.get_length();
+        auto start = std::chrono::steady_clock::now();
+        delete_at_position(replica_b, pos);
+        std::cout << "Deleted position " << pos << " from replica b (" << seconds_since(start) * 1e6 << " us)\n";
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<int> differing = replica_a.get_merkle()->diff(*replica_b.get_merkle());
+    std::cout << "Root hashes now " << replica_a.get_merkle()->root_hash() << " / "
+              << replica_b.get_merkle()->root_hash() << ", " << differing.size() << " differing segment(s) found in "
+              << seconds_since(start) * 1e6 << " us:";
+    for (int id : differing) {
+        std::cout << " " << id;
+    }
+    std::cout << "\n";
+
+    // a replica rebuilt from scratch groups its nodes differently, but must still agree on the root hash
+    DoublyLinkedList rebuilt;
+    std::vector<std::string> values;
+    std::string current = replica_b.get_head_str();
+    while (!current.empty()) {
+        values.push_back(current);
+        current = replica_b.get_next_str();
+    }
+    for (auto it = values.rbegin(); it != values.rend(); ++it) {
+        rebuilt.insert_head(*it);
+    }
+    rebuilt.enable_merkle(group_size * 2 + 1);
+    std::cout << "Rebuilt replica b with different segments: root hash " << rebuilt.get_merkle()->root_hash()
+              << (rebuilt.get_merkle()->root_hash() == replica_b.get_merkle()->root_hash() ? " (matches)\n"
+                                                                                           : " (MISMATCH)\n");
+    return 0;
+}
+
+// Run worker_func_1-style traversals over a shared list from another process until it is empty,
+// and report how fast this process could read it
+static void shm_reader(const std::string& name, int reader) {
+    // map the segment afresh, so this process sees it at its own address
+    SegmentList list(name);
+    SegmentCursor cursor;
+    long traversals = 0;
+    long nodes = 0;
+    size_t last_length = 0;
+    auto start = std::chrono::steady_clock::now();
+    while (list.get_length() > 0) {
+        std::string concatenated;
+        const char* current = list.get_head_str(cursor);
+        while (current != NULL) {
+            concatenated += current;
+            nodes++;
+            current = list.get_next_str(cursor);
+        }
+        last_length = concatenated.size();
+        traversals++;
+    }
+    double secs = seconds_since(start);
+    std::cout << "Reader " << reader << " (pid " << getpid() << "): " << traversals << " traversals, "
+              << (double)nodes / secs / 1e6 << " M nodes/s, last concatenation " << last_length << " chars\n";
+}
+
+// Share a list between processes: this process fills a shared memory list and deletes random nodes from it
+// (like worker_func_2), while forked reader processes traverse it. Usage: shm-demo [nodes] [readers] [sleep_ms]
+int shm_demo(int argc, char* argv[]) {
+    int total_nodes = (argc > 0) ? std::atoi(argv[0]) : 140;
+    int readers = (argc > 1) ? std::atoi(argv[1]) : 2;
+    int sleep_ms = (argc > 2) ? std::atoi(argv[2]) : 10;
+    std::string name = "/threads_and_mutexes." + std::to_string(getpid());
+    std::srand((unsigned int)std::time(NULL));
+
+    SegmentList list(name, (uint64_t)total_nodes);
+    for (int i = 0; i < total_nodes; i++) {
+        list.insert_head(get_random_str());
+    }
+    std::cout << "Shared list " << name << " with " << list.get_length() << " nodes\n";
+
+    std::cout.flush();
+    std::vector<pid_t> children;
+    for (int r = 0; r < readers; r++) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            shm_reader(name, r);
+            std::cout.flush();
+            _exit(0);
+        }
+        children.push_back(pid);
+    }
+
+    SegmentCursor cursor;
+    while (list.get_length() > 0) {
+        int pos_to_delete = std::rand() % list.get_length();
+        list.get_head_str(cursor);
+        for (int i = 0; i < pos_to_delete; i++) {
+            list.get_next_str(cursor);
+        }
+        list.delete_node(cursor);
+        std::this_thread::sleep_for(std::chrono::milliseconds(sleep_ms));
+    }
+    for (pid_t pid : children) {
+        waitpid(pid, NULL, 0);
+    }
+    list.unlink();
+    std::cout << "List empty: all readers stopped\n";
+    return 0;
+}
+
+// Count a persistent list's nodes by traversing it, and return the first few strings
+static int count_persistent(PersistentList& list, std::string& first) {
+    SegmentCursor cursor;
+    int count = 0;
+    for (const char* current = list.get_head_str(cursor); current != NULL; current = list.get_next_str(cursor)) {
+        if (count < 5) {
+            first += std::string(count > 0 ? " " : "") + current;
+        }
+        count++;
+    }
+    return count;
+}
+
+// Keep a list in a file across runs: the first run creates the file and fills it, and later runs recover the
+// list from it, then delete some random nodes (each flushed to disk before returning). With "crash", a child
+// process inserts and deletes nodes until it is killed with SIGKILL, and the list is recovered and checked
+// afterwards. Usage: persist-demo <file> [nodes] [deletions] [crash]
+int persist_demo(int argc, char* argv[]) {
+    if (argc < 1) {
+        std::cerr << "Usage: persist-demo <file> [nodes] [deletions] [crash]\n";
+        return 1;
+    }
+    std::string path = argv[0];
+    int total_nodes = (argc > 1) ? std::atoi(argv[1]) : 140;
+    int deletions = (argc > 2) ? std::atoi(argv[2]) : 10;
+    bool crash = (argc > 3) && std::string(argv[3]) == "crash";
+    std::srand((unsigned int)std::time(NULL));
+
+    {
+        PersistentList list(path, (uint64_t)std::max(1, total_nodes));
+        std::string first;
+        if (list.was_recovered()) {
+            int counted = count_persistent(list, first);
+            std::cout << "Recovered " << list.get_length() << " nodes from " << path << " in "
+                      << list.get_recovery_seconds() * 1000 << " ms (traversal counts " << counted << "): " << first
+                      << " ...\n";
+        }
+        else {
+            auto start = std::chrono::steady_clock::now();
+            list.set_durable(false);
+            for (int i = 0; i < total_nodes; i++) {
+                list.insert_head(get_random_str());
+            }
+            list.sync();
+            list.set_durable(true);
+            std::cout << "Created " << path << " with " << list.get_length() << " nodes in " << seconds_since(start)
+                      << " s\n";
+        }
+        auto start = std::chrono::steady_clock::now();
+        long flushes = list.get_flushes();
+        int deleted = 0;
+        SegmentCursor cursor;
+        for (; deleted < deletions && list.get_length() > 0; deleted++) {
+            int pos = std::rand() % list.get_length();
+            list.get_head_str(cursor);
+            for (int i = 0; i < pos; i++) {
+                list.get_next_str(cursor);
+            }
+            list.delete_node(cursor);
+        }
+        if (deleted > 0) {
+            std::cout << "Deleted " << deleted << " nodes, " << 1e3 * seconds_since(start) / deleted << " ms and "
+                      << (double)(list.get_flushes() - flushes) / deleted << " flushes each; " << list.get_length()
+                      << " left\n";
+        }
+    }
+    if (!crash) {
+        return 0;
+    }
+
+    std::cout.flush();
+    pid_t pid = fork();
+    if (pid == 0) {
+        // updates aren't flushed here: a killed process leaves its stores in the page cache, which is what
+        // this checks; flushing only matters if the machine goes down
+        PersistentList list(path, 1);
+        list.set_durable(false);
+        SegmentCursor cursor;
+        while (true) {
+            if (list.get_length() < total_nodes / 2 || std::rand() % 2 == 0) {
+                list.insert_head(get_random_str());
+            }
+            else {
+                int pos = std::rand() % list.get_length();
+                list.get_head_str(cursor);
+                for (int i = 0; i < pos; i++) {
+                    list.get_next_str(cursor);
+                }
+                list.delete_node(cursor);
+            }
+        }
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    PersistentList list(path, 1);
+    std::string first;
+    int counted = count_persistent(list, first);
+    std::cout << "Killed the writer mid-update; recovered " << list.get_length() << " nodes in "
+              << list.get_recovery_seconds() * 1000 << " ms, traversal counts " << counted
+              << (counted == list.get_length() ? " (consistent)" : " (INCONSISTENT)") << "\n";
+    return 0;
+}
+
+//
+// List server: a single thread owns a DoublyLinkedList and serves requests over a Unix domain socket.
+// Requests and responses are newline-terminated lines:
+//     I <string>   insert at the head       -> OK
+//     D <pos>      delete node at position  -> OK, or ERR if out of range
+//     T            traverse                 -> the concatenated strings
+//     L            length                   -> the number of nodes
+// Clients may pipeline any number of requests; everything readable on a connection is handled as one batch,
+// and the batch's responses go out in a single writev, with traversal responses pointing straight at the
+// strings in the nodes. The server thread is the only one touching the list, so those stay valid until it deletes
+// a node; the responses gathered so far are written out (or copied into pending) before each deletion.
+//
+
+struct ServerConnection {
+    int fd;
+    std::string in;
+    // response bytes that couldn't be written yet, copied out of the nodes
+    std::string pending;
+};
+
+static volatile sig_atomic_t server_stopping = 0;
+
+static void stop_server(int) {
+    server_stopping = 1;
+}
+
+// Write a batch of responses, saving anything the socket won't take into conn.pending. Returns false if the
+// connection has failed.
+static bool write_responses(ServerConnection& conn, std::vector<iovec>& iov) {
+    size_t i = 0;
+    if (conn.pending.empty()) {
+        while (i < iov.size()) {
+            int count = (int)std::min(iov.size() - i, (size_t)IOV_MAX);
+            ssize_t written = writev(conn.fd, &iov[i], count);
+            if (written < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    break;
+                }
+                if (errno == EINTR) {
+                    continue;
+                }
+                return false;
+            }
+            // skip over what was written, possibly stopping part way through an iovec
+            while (i < iov.size() && (size_t)written >= iov[i].iov_len) {
+                written -= iov[i].iov_len;
+                i++;
+            }
+            if (written > 0) {
+                iov[i].iov_base = (char*)iov[i].iov_base + written;
+                iov[i].iov_len -= written;
+                break;
+            }
+        }
+    }
+    for (; i < iov.size(); i++) {
+        conn.pending.append((const char*)iov[i].iov_base, iov[i].iov_len);
+    }
+    return true;
+}
+
+// Handle every complete request line in conn.in as one batch
+static bool handle_requests(DoublyLinkedList& dll, ServerConnection& conn) {
+    static const std::string ok = "OK\n";
+    static const std::string err = "ERR\n";
+    static const std::string newline = "\n";
+    std::vector<iovec> iov;
+    // holds response text that doesn't already live somewhere, with stable addresses until the batch is written
+    std::deque<std::string> scratch;
+    bool ok_conn = true;
+    auto respond = [&iov](const std::string& str) {
+        if (!str.empty()) {
+            iov.push_back({ (void*)str.data(), str.size() });
+        }
+    };
+
+    size_t start = 0;
+    size_t end;
+    while ((end = conn.in.find('\n', start)) != std::string::npos) {
+        const char* line = conn.in.data() + start;
+        size_t len = end - start;
+        start = end + 1;
+        if (len == 0) {
+            continue;
+        }
+        switch (line[0]) {
+        case 'I':
+            if (len > 2) {
+                dll.insert_head(std::string(line + 2, len - 2));
+                respond(ok);
+            }
+            else {
+                respond(err);
+            }
+            break;
+        case 'D': {
+            int pos = (len > 2) ? std::atoi(std::string(line + 2, len - 2).c_str()) : -1;
+            if (pos >= 0 && pos < dll.get_length()) {
+                // earlier traversal responses may point into the node about to be freed
+                ok_conn = write_responses(conn, iov) && ok_conn;
+                iov.clear();
+                delete_at_position(dll, pos);
+                respond(ok);
+            }
+            else {
+                respond(err);
+            }
+            break;
+        }
+        case 'T':
+            dll.for_each([&respond](const std::string& str) { respond(str); });
+            respond(newline);
+            break;
+        case 'L':
+            scratch.push_back(std::to_string(dll.get_length()) + "\n");
+            respond(scratch.back());
+            break;
+        default:
+            respond(err);
+        }
+    }
+    ok_conn = write_responses(conn, iov) && ok_conn;
+    conn.in.erase(0, start);
+    return ok_conn;
+}
+
+static bool flush_pending(ServerConnection& conn) {
+    while (!conn.pending.empty()) {
+        ssize_t written = write(conn.fd, conn.pending.data(), conn.pending.size());
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        conn.pending.erase(0, (size_t)written);
+    }
+    return true;
+}
+
+static int listen_unix(const std::string& path) {
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    sockaddr_un addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    std::strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+    ::unlink(path.c_str());
+    if (fd < 0 || bind(fd, (sockaddr*)&addr, sizeof(addr)) != 0 || listen(fd, SOMAXCONN) != 0) {
+        std::cerr << "Can't listen on " << path << ": " << std::strerror(errno) << "\n";
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    return fd;
+}
+
+// Serve a list of random strings over a Unix domain socket until interrupted. Usage: serve <socket> [nodes]
+int serve(int argc, char* argv[]) {
+    if (argc < 1) {
+        std::cerr << "Usage: serve <socket> [nodes]\n";
+        return 1;
+    }
+    std::string path = argv[0];
+    int total_nodes = (argc > 1) ? std::atoi(argv[1]) : 140;
+    std::srand((unsigned int)std::time(NULL));
+    DoublyLinkedList dll;
+    for (int i = 0; i < total_nodes; i++) {
+        dll.insert_head(get_random_str());
+    }
+
+    int listen_fd = listen_unix(path);
+    if (listen_fd < 0) {
+        return 1;
+    }
+    // no SA_RESTART, so that epoll_wait returns on a signal
+    struct sigaction sa;
+    std::memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = stop_server;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+    // bytes of responses waiting for their clients to read them, across all connections
+    std::atomic<long> output_queue(0);
+    int gauges[2] = {
+        stats_registry.add_gauge("list_length", [&dll]() { return dll.get_length(); }),
+        stats_registry.add_gauge("output_queue_bytes", [&output_queue]() { return output_queue.load(); }),
+    };
+    stats_registry.start_signal_reporter("");
+
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev);
+    std::cout << "Serving " << dll.get_length() << " nodes on " << path << "\n";
+    std::cout.flush();
+
+    std::vector<epoll_event> events(64);
+    char buf[65536];
+    long connections = 0;
+    while (!server_stopping) {
+        int n = epoll_wait(epoll_fd, events.data(), (int)events.size(), -1);
+        for (int e = 0; e < n; e++) {
+            ServerConnection* conn = (ServerConnection*)events[e].data.ptr;
+            if (conn == NULL) {
+                // new connections on the listening socket
+                int fd;
+                while ((fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+                    ServerConnection* c = new ServerConnection();
+                    c->fd = fd;
+                    epoll_event cev;
+                    cev.events = EPOLLIN | EPOLLRDHUP;
+                    cev.data.ptr = c;
+                    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &cev);
+                    connections++;
+                }
+                continue;
+            }
+
+            bool alive = true;
+            long queued = (long)conn->pending.size();
+            if (events[e].events & EPOLLOUT) {
+                alive = flush_pending(*conn);
+            }
+            if (alive && (events[e].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))) {
+                bool eof = false;
+                while (true) {
+                    ssize_t got = read(conn->fd, buf, sizeof(buf));
+                    if (got > 0) {
+                        conn->in.append(buf, (size_t)got);
+                        continue;
+                    }
+                    if (got < 0 && errno == EINTR) {
+                        continue;
+                    }
+                    eof = (got == 0 || (errno != EAGAIN && errno != EWOULDBLOCK));
+                    break;
+                }
+                alive = handle_requests(dll, *conn) && !eof;
+            }
+            output_queue += (alive ? (long)conn->pending.size() : 0) - queued;
+            if (!alive) {
+                epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+                close(conn->fd);
+                delete conn;
+                continue;
+            }
+            // only ask for writability while there is something waiting to go out
+            epoll_event cev;
+            cev.events = EPOLLIN | EPOLLRDHUP | (conn->pending.empty() ? 0u : (uint32_t)EPOLLOUT);
+            cev.data.ptr = conn;
+            epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->fd, &cev);
+        }
+    }
+    stats_registry.stop_signal_reporter();
+    for (int id : gauges) {
+        stats_registry.remove_gauge(id);
+    }
+    close(epoll_fd);
+    close(listen_fd);
+    ::unlink(path.c_str());
+    std::cout << "Server stopping after " << connections << " connection(s), " << dll.get_length() << " nodes left\n";
+    return 0;
+}
+
+// One load generator connection: send batches of pipelined requests and wait for all their responses
+static void loadgen_client(const std::string& path, int pipeline, std::chrono::steady_clock::time_point until,
+                           long& requests) {
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    sockaddr_un addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    std::strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+    if (fd < 0 || connect(fd, (sockaddr*)&addr, sizeof(addr)) != 0) {
+        std::cerr << "Can't connect to " << path << ": " << std::strerror(errno) << "\n";
+        if (fd >= 0) {
+            close(fd);
+        }
+        return;
+    }
+
+    // mix of mostly reads, with inserts and deletes balanced to keep the list length steady
+    std::string batch;
+    for (int i = 0; i < pipeline; i++) {
+        switch (i % 8) {
+        case 0:
+            batch += "T\n";
+            break;
+        case 1:
+            batch += "I " + get_random_str() + "\n";
+            break;
+        case 2:
+            batch += "D 0\n";
+            break;
+        default:
+            batch += "L\n";
+        }
+    }
+    char buf[65536];
+    while (std::chrono::steady_clock::now() < until) {
+        if (write(fd, batch.data(), batch.size()) != (ssize_t)batch.size()) {
+            break;
+        }
+        int lines = 0;
+        while (lines < pipeline) {
+            ssize_t got = read(fd, buf, sizeof(buf));
+            if (got <= 0) {
+                close(fd);
+                return;
+            }
+            lines += (int)std::count(buf, buf + got, '\n');
+        }
+        requests += pipeline;
+    }
+    close(fd);
+}
+
+// Measure the request rate of a running server. Usage: loadgen <socket> [connections] [seconds] [pipeline]
+int loadgen(int argc, char* argv[]) {
+    if (argc < 1) {
+        std::cerr << "Usage: loadgen <socket> [connections] [seconds] [pipeline]\n";
+        return 1;
+    }
+    std::string path = argv[0];
+    int connections = (argc > 1) ? std::atoi(argv[1]) : 4;
+    double seconds = (argc > 2) ? std::atof(argv[2]) : 5;
+    int pipeline = (argc > 3) ? std::max(1, std::atoi(argv[3])) : 32;
+    std::srand((unsigned int)std::time(NULL));
+
+    auto start = std::chrono::steady_clock::now();
+    auto until = start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                             std::chrono::duration<double>(seconds));
+    std::vector<long> requests(connections, 0);
+    std::vector<std::thread> clients;
+    for (int c = 0; c < connections; c++) {
+        clients.emplace_back(loadgen_client, path, pipeline, until, std::ref(requests[c]));
+    }
+    for (std::thread& client : clients) {
+        client.join();
+    }
+    double secs = seconds_since(start);
+    long total = 0;
+    for (long r : requests) {
+        total += r;
+    }
+    std::cout << connections << " connection(s), pipeline " << pipeline << ": " << total << " requests in " << secs
+              << " s = " << (double)total / secs << " requests/s\n";
+    return 0;
+}
+
+// Replay a recorded trace at full speed. In sequential mode the operations are applied one at a time in the
+// order they were recorded, which reproduces the recorded run's list exactly. In threaded mode each recorded
+// thread's operations are replayed on a thread of their own, concurrently, after the initial inserts. The list
+// can be set up with a different strategy from the recorded run's, to compare them on the same operations.
+// Usage: replay <trace> [sequential|threaded] [--lazy-delete] [--unlocked-walk] [--granularity <mode>]
+int replay(int argc, char* argv[]) {
+    const char* usage =
+        "Usage: replay <trace> [sequential|threaded] [--lazy-delete] [--unlocked-walk] [--granularity <mode>]\n";
+    if (argc < 1) {
+        std::cerr << usage;
+        return 1;
+    }
+    bool threaded = false;
+    bool lazy_delete = false;
+    bool unlocked_walk = false;
+    LockGranularity granularity = GRANULARITY_FINE;
+    for (int i = 1; i < argc; i++) {
+        std::string opt = argv[i];
+        if (opt == "threaded" || opt == "sequential") {
+            threaded = (opt == "threaded");
+        }
+        else if (opt == "--lazy-delete") {
+            lazy_delete = true;
+        }
+        else if (opt == "--unlocked-walk") {
+            unlocked_walk = true;
+        }
+        else if (opt == "--granularity" && i + 1 < argc) {
+            std::string name = argv[++i];
+            if (name == "coarse") {
+                granularity = GRANULARITY_COARSE;
+            }
+            else if (name == "adaptive") {
+                granularity = GRANULARITY_ADAPTIVE;
+            }
+            else if (name != "fine") {
+                std::cerr << "Unknown granularity: " << name << "\n";
+                return 1;
+            }
+        }
+        else {
+            std::cerr << usage;
+            return 1;
+        }
+    }
+    unsigned int seed;
+    std::vector<TraceEntry> entries;
+    if (!read_trace(argv[0], seed, entries)) {
+        std::cerr << "Can't read trace " << argv[0] << "\n";
+        return 1;
+    }
+    std::cout << "Replaying " << entries.size() << " operations recorded with seed " << seed << " over "
+              << (entries.empty() ? 0 : entries.back().rec.time_ns / 1e9) << " s\n";
+
+    DoublyLinkedList dll;
+    dll.set_lazy_delete(lazy_delete);
+    dll.set_unlocked_walk(unlocked_walk);
+    if (!dll.set_granularity(granularity)) {
+        std::cerr << "--granularity coarse/adaptive can't be used with lazy deletion or unlocked walks\n";
+        return 1;
+    }
+    auto start = std::chrono::steady_clock::now();
+    if (!threaded) {
+        std::vector<const TraceEntry*> all;
+        for (const TraceEntry& entry : entries) {
+            all.push_back(&entry);
+        }
+        replay_entries(all, dll);
+    }
+    else {
+        // the list is built by the thread that recorded the inserts, before any worker starts
+        std::map<uint32_t, std::vector<const TraceEntry*>> streams;
+        size_t i = 0;
+        std::vector<const TraceEntry*> setup;
+        for (; i < entries.size() && entries[i].rec.op == TRACE_INSERT; i++) {
+            setup.push_back(&entries[i]);
+        }
+        replay_entries(setup, dll);
+        for (; i < entries.size(); i++) {
+            streams[entries[i].rec.thread].push_back(&entries[i]);
+        }
+        std::vector<std::thread> threads;
+        for (auto& stream : streams) {
+            threads.emplace_back([&stream, &dll]() { replay_entries(stream.second, dll); });
+        }
+        for (std::thread& t : threads) {
+            t.join();
+        }
+    }
+    double secs = seconds_since(start);
+    std::cout << "Replayed in " << secs << " s (" << (double)entries.size() / secs << " ops/s), "
+              << dll.get_length() << " nodes left\n";
+    return 0;
+}
+
+// Producers queue bursts of deletes and inserts (balanced, so the list length stays steady) through the lock-free
+// command queue while a reader keeps traversing, and report the producers' enqueue latency and the applier's
+// throughput. Usage: queue-bench [producers] [seconds] [nodes] [burst]
+int queue_bench(int argc, char* argv[]) {
+    int producers = (argc > 0) ? std::atoi(argv[0]) : 4;
+    double seconds = (argc > 1) ? std::atof(argv[1]) : 3;
+    int total_nodes = (argc > 2) ? std::atoi(argv[2]) : 140;
+    int burst = (argc > 3) ? std::max(1, std::atoi(argv[3])) : 256;
+
+    DoublyLinkedList dll;
+    fill_random(dll, total_nodes, (unsigned int)std::time(NULL));
+    std::atomic<bool> done(false);
+    std::atomic<long> traversals(0);
+    std::atomic<long> max_depth(0);
+    std::vector<std::vector<double>> latencies(producers);
+    auto start = std::chrono::steady_clock::now();
+    auto until = start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                             std::chrono::duration<double>(seconds));
+    {
+        CommandApplier applier(dll);
+        std::thread reader([&dll, &done, &traversals]() {
+            while (!done) {
+                std::string current = dll.get_head_str();
+                while (!current.empty()) {
+                    current = dll.get_next_str();
+                }
+                traversals++;
+            }
+        });
+        std::vector<std::thread> threads;
+        for (int p = 0; p < producers; p++) {
+            threads.emplace_back([&, p]() {
+                std::vector<double>& lat = latencies[p];
+                unsigned int seed = (unsigned int)p;
+                while (std::chrono::steady_clock::now() < until) {
+                    for (int i = 0; i < burst; i++) {
+                        auto t0 = std::chrono::steady_clock::now();
+                        if (i % 2 == 0) {
+                            applier.submit_delete(rand_r(&seed) % std::max(1, total_nodes));
+                        }
+                        else {
+                            applier.submit_insert("burst");
+                        }
+                        lat.push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() -
+                                                                               t0).count());
+                    }
+                    long depth = applier.get_depth();
+                    long seen = max_depth.load();
+                    while (depth > seen && !max_depth.compare_exchange_weak(seen, depth)) {
+                    }
+                    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                }
+            });
+        }
+        for (std::thread& t : threads) {
+            t.join();
+        }
+        // the applier drains whatever is left when it is destroyed
+        done = true;
+        reader.join();
+        std::cout << "Applied " << applier.get_applied() << " commands in " << seconds_since(start) << " s ("
+                  << (double)applier.get_applied() / seconds_since(start) << " /s), max queue depth " << max_depth
+                  << ", reader traversals " << traversals << "\n";
+    }
+
+    std::vector<double> all;
+    for (std::vector<double>& lat : latencies) {
+        all.insert(all.end(), lat.begin(), lat.end());
+    }
+    std::sort(all.begin(), all.end());
+    if (!all.empty()) {
+        auto pct = [&all](double p) { return all[std::min(all.size() - 1, (size_t)(p * all.size()))]; };
+        std::cout << "Enqueue latency over " << all.size() << " commands from " << producers
+                  << " producer(s): p50 " << pct(0.5) << " us, p99 " << pct(0.99) << " us, p99.9 " << pct(0.999)
+                  << " us, max " << all.back() << " us\n";
+    }
+    std::cout << dll.get_length() << " nodes left\n";
+    print_node_allocs();
+    return 0;
+}
+
+// Print percentiles of a set of latencies (in microseconds), sorting them in place
+static void print_latencies(const std::string& label, std::vector<double>& lat) {
+    if (lat.empty()) {
+        std::cout << label << ": no samples\n";
+        return;
+    }
+    std::sort(lat.begin(), lat.end());
+    auto pct = [&lat](double p) { return lat[std::min(lat.size() - 1, (size_t)(p * lat.size()))]; };
+    std::cout << label << ": " << lat.size() << " samples, p50 " << pct(0.5) << " us, p99 " << pct(0.99)
+              << " us, max " << lat.back() << " us\n";
+}
+
+// Measure how long deletions take while a slow reader (pausing at every node) traverses the list, first with
+// the locking get_head_str/get_next_str/delete_node API and then with cursors.
+// Usage: cursor-bench [nodes] [deletions] [pause_us]
+int cursor_bench(int argc, char* argv[]) {
+    int total_nodes = (argc > 0) ? std::atoi(argv[0]) : 140;
+    int deletions = (argc > 1) ? std::atoi(argv[1]) : 100;
+    int pause_us = (argc > 2) ? std::atoi(argv[2]) : 200;
+    unsigned int seed = (unsigned int)std::time(NULL);
+
+    for (int use_cursors = 0; use_cursors < 2; use_cursors++) {
+        DoublyLinkedList dll;
+        fill_random(dll, total_nodes, seed);
+        std::atomic<bool> done(false);
+        std::thread reader([&]() {
+            while (!done) {
+                if (use_cursors) {
+                    ListCursor cursor;
+                    for (bool more = dll.cursor_begin(cursor); more && !done; more = dll.cursor_next(cursor)) {
+                        std::this_thread::sleep_for(std::chrono::microseconds(pause_us));
+                    }
+                }
+                else {
+                    std::string current = dll.get_head_str();
+                    while (!current.empty()) {
+                        std::this_thread::sleep_for(std::chrono::microseconds(pause_us));
+                        current = dll.get_next_str();
+                    }
+                }
+            }
+        });
+
+        std::vector<double> lat;
+        for (int d = 0; d < deletions && dll.get_length() > 1; d++) {
+            int pos = std::rand() % dll.get_length();
+            auto start = std::chrono::steady_clock::now();
+            if (use_cursors) {
+                ListCursor cursor;
+                dll.cursor_begin(cursor);
+                for (int i = 0; i < pos && cursor.valid(); i++) {
+                    dll.cursor_next(cursor);
+                }
+                dll.cursor_erase(cursor);
+            }
+            else {
+                delete_at_position(dll, pos);
+            }
+            lat.push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count());
+            std::this_thread::sleep_for(std::chrono::microseconds(500));
+        }
+        done = true;
+        reader.join();
+        print_latencies(use_cursors ? "cursors  " : "node locks", lat);
+    }
+    print_node_allocs();
+    return 0;
+}
+
+// Measure how group commit scales: for increasing numbers of threads, each repeatedly deletes a random node,
+// inserts a new one and commits, against a list logging to path. Reports the throughput, the commit latency, and
+// how many records each fdatasync covered on average. The leader waits delay_us before each sync, to gather
+// bigger groups. Usage: wal-bench <path> [nodes] [seconds] [delay_us]
+int wal_bench(int argc, char* argv[]) {
+    if (argc < 1) {
+        std::cerr << "Usage: wal-bench <path> [nodes] [seconds] [delay_us]\n";
+        return 1;
+    }
+    std::string path = argv[0];
+    int total_nodes = (argc > 1) ? std::atoi(argv[1]) : 1000;
+    double seconds = (argc > 2) ? std::atof(argv[2]) : 1;
+    std::chrono::microseconds delay((argc > 3) ? std::atol(argv[3]) : 0);
+    unsigned int seed = (unsigned int)std::time(NULL);
+
+    for (int num_threads = 1; num_threads <= 32; num_threads *= 2) {
+        DoublyLinkedList dll;
+        fill_random(dll, total_nodes, seed);
+        dll.set_unlocked_walk(true);
+        dll.attach_log(path, delay);
+        std::atomic<bool> done(false);
+        std::vector<std::vector<double>> lat(num_threads);
+        std::vector<std::thread> threads;
+        auto start = std::chrono::steady_clock::now();
+        for (int t = 0; t < num_threads; t++) {
+            threads.emplace_back([&dll, &done, &lat, t, seed]() {
+                unsigned int thread_seed = seed + t;
+                while (!done) {
+                    dll.delete_at(rand_r(&thread_seed) % std::max(1, dll.get_length()));
+                    std::string data(rand_r(&thread_seed) % 7 + 3, 'a');
+                    for (char& c : data) {
+                        c = 'a' + rand_r(&thread_seed) % 26;
+                    }
+                    dll.insert_head(data);
+                    auto commit_start = std::chrono::steady_clock::now();
+                    dll.commit();
+                    lat[t].push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now()
+                                                                                - commit_start).count());
+                }
+            });
+        }
+        std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+        done = true;
+        for (std::thread& thread : threads) {
+            thread.join();
+        }
+        double elapsed = seconds_since(start);
+        std::vector<double> all;
+        for (std::vector<double>& l : lat) {
+            all.insert(all.end(), l.begin(), l.end());
+        }
+        MutationLog* log = dll.get_log();
+        std::cout << num_threads << " threads: " << (long)(all.size() / elapsed) << " commits/s, "
+                  << log->get_syncs() << " syncs, "
+                  << (double)log->get_synced_records() / std::max(1L, log->get_syncs()) << " records per sync\n";
+        print_latencies("    commit", all);
+    }
+    return 0;
+}
+
+// Compare the lock granularities over a daily load cycle: a quiet phase (one reader), a busy one (8 readers) and
+// a quiet one again, each lasting the given time, with one writer throughout (delete_node, like worker_func_2,
+// expects a single deleter). Readers traverse the whole list; the writer walks to a random node, deletes it and
+// inserts a new one. Reports traversals and writes per second in each phase, and for adaptive, the granularity at
+// the end of each phase and the switches made.
+// Usage: adaptive-bench [nodes] [seconds]
+int adaptive_bench(int argc, char* argv[]) {
+    int total_nodes = (argc > 0) ? std::atoi(argv[0]) : 140;
+    double seconds = (argc > 1) ? std::atof(argv[1]) : 1;
+    unsigned int seed = (unsigned int)std::time(NULL);
+    const int phase_readers[] = { 1, 8, 1 };
+    const char* const names[] = { "fine    ", "coarse  ", "adaptive" };
+
+    for (int g = GRANULARITY_FINE; g <= GRANULARITY_ADAPTIVE; g++) {
+        DoublyLinkedList dll;
+        fill_random(dll, total_nodes, seed);
+        dll.set_granularity((LockGranularity)g);
+        std::cout << names[g] << ":";
+        for (int readers : phase_readers) {
+            std::atomic<bool> done(false);
+            std::atomic<long> traversals(0);
+            std::atomic<long> writes(0);
+            std::vector<std::thread> threads;
+            for (int t = 0; t < readers; t++) {
+                threads.emplace_back([&dll, &done, &traversals]() {
+                    while (!done) {
+                        std::string current = dll.get_head_str();
+                        while (!current.empty()) {
+                            current = dll.get_next_str();
+                        }
+                        traversals++;
+                    }
+                });
+            }
+            threads.emplace_back([&dll, &done, &writes, seed]() {
+                unsigned int thread_seed = seed;
+                while (!done) {
+                    int pos = rand_r(&thread_seed) % std::max(1, dll.get_length());
+                    dll.get_head_str();
+                    for (int i = 0; i < pos; i++) {
+                        dll.get_next_str();
+                    }
+                    dll.delete_node();
+                    dll.insert_head(std::string(rand_r(&thread_seed) % 7 + 3, 'a' + rand_r(&thread_seed) % 26));
+                    writes++;
+                }
+            });
+            auto start = std::chrono::steady_clock::now();
+            std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+            done = true;
+            for (std::thread& thread : threads) {
+                thread.join();
+            }
+            double elapsed = seconds_since(start);
+            std::cout << "  " << readers << " readers " << (long)(traversals / elapsed) << " traversals/s "
+                      << (long)(writes / elapsed) << " writes/s";
+            if (g == GRANULARITY_ADAPTIVE) {
+                std::cout << " (" << (dll.is_coarse() ? "coarse" : "fine") << ")";
+            }
+        }
+        if (g == GRANULARITY_ADAPTIVE) {
+            std::cout << ", " << dll.get_granularity_switches() << " switches";
+        }
+        std::cout << "\n";
+    }
+    return 0;
+}
+
+// Fill a list with a Bloom filter enabled, delete half the nodes, then query random strings and compare the
+// filter's false-positive rate against the expected one, and the time per query with and without the filter.
+// Usage: bloom-demo [nodes] [cells] [hashes] [queries]
+int bloom_demo(int argc, char* argv[]) {
+    int total_nodes = (argc > 0) ? std::atoi(argv[0]) : 1000;
+    size_t cells = (argc > 1) ? (size_t)std::atol(argv[1]) : 16384;
+    int hashes = (argc > 2) ? std::atoi(argv[2]) : 4;
+    int queries = (argc > 3) ? std::atoi(argv[3]) : 20000;
+
+    DoublyLinkedList dll;
+    dll.enable_bloom(cells, hashes);
+    fill_random(dll, total_nodes, (unsigned int)std::time(NULL));
+    for (int i = 0; i < total_nodes / 2 && dll.get_length() > 0; i++) {
+        delete_at_position(dll, std::rand() % dll.get_length());
+    }
+    std::unordered_map<std::string, int> present;
+    dll.for_each([&present](const std::string& s) { present[s]++; });
+    PayloadBloom* bloom = dll.get_bloom();
+    std::cout << dll.get_length() << " nodes (" << present.size() << " distinct strings), " << bloom->get_cells()
+              << " counters x " << bloom->get_hashes() << " hashes, " << bloom->get_memory() << " bytes\n";
+
+    // only strings that aren't in the list can be false positives
+    std::vector<std::string> absent;
+    while ((int)absent.size() < queries) {
+        std::string s = get_random_str();
+        if (present.count(s) == 0) {
+            absent.push_back(s);
+        }
+    }
+    int false_positives = 0;
+    for (const std::string& s : absent) {
+        false_positives += bloom->maybe_contains(s) ? 1 : 0;
+    }
+    std::cout << "False positives: " << false_positives << " of " << queries << " absent strings ("
+              << 100.0 * false_positives / queries << "%), expected "
+              << 100.0 * bloom->expected_fp_rate(present.size()) << "%\n";
+
+    auto start = std::chrono::steady_clock::now();
+    int found = 0;
+    for (const std::string& s : absent) {
+        found += dll.contains(s) ? 1 : 0;
+    }
+    double with_bloom = seconds_since(start);
+    // without the filter, every query has to walk the whole list
+    start = std::chrono::steady_clock::now();
+    for (const std::string& s : absent) {
+        bool hit = false;
+        dll.for_each([&s, &hit](const std::string& str) { hit = hit || str == s; });
+        found += hit ? 1 : 0;
+    }
+    double without_bloom = seconds_since(start);
+    std::cout << "contains: " << 1e6 * with_bloom / queries << " us per query with the filter, "
+              << 1e6 * without_bloom / queries << " us without (" << found << " found)\n";
+    return 0;
+}
+
+// Fill a list and report how many of its strings repeat, overall and by string length, how far interning the
+// ones too long to keep in a node deduplicates them, and the memory the strings take compared with one
+// std::string per node. Strings short enough to keep in a node (all of the default workload's) are never
+// interned, so without copies there is nothing to save. Strings can be limited to fewer than 9 chars, for a
+// workload with more duplicates, and repeated end to end, to make them too long to keep in a node.
+// Usage: intern-demo [nodes] [max_length] [copies]
+int intern_demo(int argc, char* argv[]) {
+    int total_nodes = (argc > 0) ? std::atoi(argv[0]) : 1000000;
+    int max_length = (argc > 1) ? std::max(3, std::min(9, std::atoi(argv[1]))) : 9;
+    int copies = (argc > 2) ? std::max(1, std::atoi(argv[2])) : 1;
+
+    DoublyLinkedList dll;
+    auto start = std::chrono::steady_clock::now();
+    std::srand((unsigned int)std::time(NULL));
+    for (int i = 0; i < total_nodes; i++) {
+        std::string str = get_random_str();
+        str.resize(std::min((int)str.size(), max_length));
+        std::string repeated;
+        for (int c = 0; c < copies; c++) {
+            repeated += str;
+        }
+        dll.insert_head(repeated);
+    }
+    std::cout << "Filled " << total_nodes << " nodes in " << seconds_since(start) << " s\n";
+
+    // a std::string per node would also need a heap buffer for each string too long for its own buffer
+    std::map<size_t, std::pair<long, std::unordered_map<std::string, int>>> by_length;
+    size_t heap_bytes = 0;
+    dll.for_each([&by_length, &heap_bytes](const std::string& s) {
+        by_length[s.size()].first++;
+        by_length[s.size()].second[s]++;
+        if (s.size() > std::string().capacity()) {
+            heap_bytes += s.capacity() + 1;
+        }
+    });
+    for (auto& entry : by_length) {
+        long nodes = entry.second.first;
+        size_t distinct = entry.second.second.size();
+        std::cout << "  length " << entry.first << ": " << nodes << " nodes, " << distinct << " distinct, dedup "
+                  << (double)nodes / distinct << "x\n";
+    }
+    long refs = string_table.get_references();
+    long payloads = string_table.get_payloads();
+    // either way each node has a std::string's worth of room for its string (or its payload pointer)
+    size_t before = (size_t)total_nodes * sizeof(std::string) + heap_bytes;
+    size_t after = (size_t)total_nodes * sizeof(std::string) + string_table.get_memory();
+    std::cout << total_nodes - refs << " strings kept in their nodes, " << refs << " interned as " << payloads
+              << " payloads, dedup ratio " << (payloads > 0 ? (double)refs / payloads : 0.0) << "x\n";
+    if (refs == 0) {
+        std::cout << "No string is long enough to be interned, so the strings take the same "
+                  << before / 1024 << " KiB as with a std::string per node\n";
+        return 0;
+    }
+    std::cout << "String memory: about " << after / 1024 << " KiB with interning, against " << before / 1024
+              << " KiB for a std::string per node (" << (after < before ? "saving " : "costing ")
+              << (after < before ? before - after : after - before) / 1024 << " KiB)\n";
+    return 0;
+}
+
+// How many nodes have been allocated, and how many of those needed fresh memory rather than a recycled node
+static void print_node_allocs() {
+    uint64_t allocs = node_allocator.get_allocs();
+    uint64_t mallocs = node_allocator.get_mallocs();
+    std::cout << "Node allocations: " << allocs << ", " << mallocs << " from malloc, " << allocs - mallocs
+              << " recycled\n";
+}
+
+//
+// Self-test: checks with known answers for paths the demos and benchmarks exercise without checking the results
+//
+
+static int self_test_checks = 0;
+static int self_test_failures = 0;
+
+// Record and print the outcome of one check
+static void self_check(bool passed, const std::string& what) {
+    self_test_checks++;
+    if (!passed) {
+        self_test_failures++;
+    }
+    std::cout << (passed ? "ok      " : "FAILED  ") << what << "\n";
+}
+
+// Read everything from fd until the other end is closed
+static std::string read_all(int fd) {
+    std::string out;
+    char buf[4096];
+    ssize_t got;
+    while ((got = read(fd, buf, sizeof(buf))) != 0) {
+        if (got < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        out.append(buf, (size_t)got);
+    }
+    return out;
+}
+
+// A traversal pipelined ahead of deletions in the same batch must get the strings as they were, even though
+// the deletions free the nodes before the batch's responses are written
+static void test_serve_pipeline() {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) != 0) {
+        self_check(false, "serve: socketpair");
+        return;
+    }
+    DoublyLinkedList dll;
+    std::string long_str(40, 'A');
+    ServerConnection conn;
+    conn.fd = fds[0];
+    conn.in = "I " + long_str + "\nI abc\nT\nD 0\nD 0\nT\nL\n";
+    bool alive = handle_requests(dll, conn);
+    alive = flush_pending(conn) && alive;
+    close(fds[0]);
+    std::string out = read_all(fds[1]);
+    close(fds[1]);
+    self_check(alive && out == "OK\nOK\nabc" + long_str + "\nOK\nOK\n\n0\n",
+               "serve: pipelined traversal then deletions in one batch");
+}
+
+// Remove the checkpoint and log that attach_log made at path
+static void remove_log_files(const std::string& path) {
+    ::unlink((path + ".snap").c_str());
+    ::unlink((path + ".log").c_str());
+}
+
+// The list's strings in order
+static std::vector<std::string> list_strings(DoublyLinkedList& dll) {
+    std::vector<std::string> out;
+    dll.for_each([&out](const std::string& s) { out.push_back(s); });
+    return out;
+}
+
+// Deletions in lazy-delete mode must log the ids of the nodes they delete, even while the sweeper is freeing
+// dead nodes, so that recovering from the log gives back the same list
+static void test_lazy_delete_wal(const std::string& dir) {
+    std::string path = dir + "/lazy";
+    std::vector<std::string> expected;
+    {
+        DoublyLinkedList dll;
+        dll.attach_log(path, std::chrono::microseconds(0));
+        dll.set_lazy_delete(true);
+        fill_random(dll, 2000, 1);
+        for (int i = 0; i < 1500; i++) {
+            delete_at_position(dll, std::rand() % dll.get_length());
+            // give the sweeper a chance to run between deletions
+            if (i % 100 == 0) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(15));
+            }
+        }
+        dll.commit();
+        dll.set_lazy_delete(false);
+        expected = list_strings(dll);
+    }
+    DoublyLinkedList recovered;
+    bool found = recovered.recover(path);
+    self_check(found && recovered.get_length() == (int)expected.size() && list_strings(recovered) == expected,
+               "wal: recovering lazy deletions gives back the same list");
+    remove_log_files(path);
+}
+
+static std::string read_file(const std::string& path) {
+    std::ifstream in(path, std::ios::binary);
+    return std::string(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+}
+
+static void write_file(const std::string& path, const std::string& contents) {
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    out << contents;
+}
+
+// A crash in attach_log after the new checkpoint is renamed into place but before the old log's truncation
+// reaches the disk leaves the new checkpoint next to the old log. Recovering from that must not apply the old
+// log's changes a second time.
+static void test_wal_crash_mid_checkpoint(const std::string& dir) {
+    std::string path = dir + "/checkpoint";
+    {
+        DoublyLinkedList dll;
+        dll.attach_log(path, std::chrono::microseconds(0));
+        fill_random(dll, 500, 2);
+        for (int i = 0; i < 200; i++) {
+            delete_at_position(dll, std::rand() % dll.get_length());
+        }
+        dll.commit();
+    }
+    std::string old_log = read_file(path + ".log");
+    std::vector<std::string> expected;
+    {
+        // the next run recovers and checkpoints, then "crashes" with the old log still on disk
+        DoublyLinkedList dll;
+        dll.recover(path);
+        dll.attach_log(path, std::chrono::microseconds(0));
+        expected = list_strings(dll);
+    }
+    write_file(path + ".log", old_log);
+    DoublyLinkedList recovered;
+    recovered.recover(path);
+    self_check(!old_log.empty() && recovered.get_length() == (int)expected.size() &&
+                   list_strings(recovered) == expected,
+               "wal: recovering the new checkpoint with the old log doesn't repeat its changes");
+    remove_log_files(path);
+}
+
+// A recorded trace must read back as the operations that were recorded, with no padding between records, and
+// replaying it must leave the list the recording run left
+static void test_trace_round_trip(const std::string& dir) {
+    std::string path = dir + "/trace";
+    const char* strings[] = { "abc", "defg", "hijklm", "nop", "qrstuvwxy" };
+    trace_recorder = new TraceRecorder(path, 42);
+    for (const char* str : strings) {
+        trace_recorder->record(TRACE_INSERT, 0, str);
+    }
+    trace_recorder->record(TRACE_DELETE, 2);
+    trace_recorder->record(TRACE_TRAVERSE, 4);
+    trace_recorder->record(TRACE_DELETE, 0);
+    delete trace_recorder;
+    trace_recorder = NULL;
+
+    unsigned int seed = 0;
+    std::vector<TraceEntry> entries;
+    bool read = read_trace(path, seed, entries);
+    size_t expected_size = sizeof(trace_magic) + 4 + 8 * trace_record_size + 3 + 4 + 6 + 3 + 9;
+    bool matches = read && seed == 42 && entries.size() == 8 && read_file(path).size() == expected_size;
+    for (size_t i = 0; matches && i < entries.size(); i++) {
+        const TraceRecord& rec = entries[i].rec;
+        matches = rec.thread == 0 && (i == 0 || rec.time_ns >= entries[i - 1].rec.time_ns) &&
+                  ((i < 5 && rec.op == TRACE_INSERT && entries[i].data == strings[i] &&
+                    rec.len == entries[i].data.size())
+                   || (i == 5 && rec.op == TRACE_DELETE && rec.arg == 2)
+                   || (i == 6 && rec.op == TRACE_TRAVERSE && rec.arg == 4)
+                   || (i == 7 && rec.op == TRACE_DELETE && rec.arg == 0));
+    }
+    self_check(matches, "trace: records read back as written, 19 bytes each");
+
+    std::vector<const TraceEntry*> all;
+    for (const TraceEntry& entry : entries) {
+        all.push_back(&entry);
+    }
+    DoublyLinkedList dll;
+    replay_entries(all, dll);
+    self_check(list_strings(dll) == std::vector<std::string>({ "nop", "defg", "abc" }),
+               "trace: replaying leaves the list the recorded operations left");
+    ::unlink(path.c_str());
+}
+
+// Deleting the head while another thread inserts new heads mustn't lose any of them: every node the list counts
+// must still be reachable from the head
+static void test_delete_head_during_inserts() {
+    DoublyLinkedList dll;
+    fill_random(dll, 100, 4);
+    std::atomic<bool> inserting(true);
+    std::thread inserter([&dll, &inserting]() {
+        for (int i = 0; i < 20000; i++) {
+            dll.insert_head("new");
+        }
+        inserting = false;
+    });
+    int deleted = 0;
+    while (inserting || deleted < 100) {
+        if (dll.get_length() > 0) {
+            delete_at_position(dll, 0);
+            deleted++;
+        }
+    }
+    inserter.join();
+    self_check((int)list_strings(dll).size() == dll.get_length(),
+               "delete_node: deleting the head during inserts keeps every node reachable");
+}
+
+// An optimistic snapshot (one that didn't fall back to node locks, which sort excludes) taken while the list is
+// being sorted must see the list either before or after the sort, never half relinked
+static void test_snapshot_during_sort() {
+    DoublyLinkedList dll;
+    fill_random(dll, 1000, 5);
+    dll.set_seqlock_reads(true);
+    std::vector<std::string> before = list_strings(dll);
+    std::vector<std::string> after = before;
+    std::sort(after.begin(), after.end());
+    std::atomic<bool> sorting(true);
+    bool consistent = true;
+    std::thread reader([&dll, &sorting, &consistent, &before, &after]() {
+        while (sorting) {
+            std::vector<std::string> strings;
+            uint64_t fallbacks = dll.get_fallback_reads();
+            dll.snapshot(strings);
+            if (dll.get_fallback_reads() == fallbacks) {
+                consistent = consistent && (strings == before || strings == after);
+            }
+        }
+    });
+    // a snapshot that falls back to node locks makes sort refuse; try again until it gets the list to itself
+    bool sorted = false;
+    while (!sorted) {
+        try {
+            dll.sort(2);
+            sorted = true;
+        }
+        catch (const std::logic_error&) {
+            std::this_thread::yield();
+        }
+    }
+    sorting = false;
+    reader.join();
+    self_check(consistent && list_strings(dll) == after,
+               "sort: concurrent optimistic snapshots see the list before or after");
+}
+
+// Move the cursor to the first node with the given string. Returns false if there is none.
+static bool cursor_to(DoublyLinkedList& dll, ListCursor& cursor, const std::string& str) {
+    bool more = dll.cursor_begin(cursor);
+    while (more && cursor.data() != str) {
+        more = dll.cursor_next(cursor);
+    }
+    return more;
+}
+
+// A cursor must carry on past its node after the node is deleted, and splice and split_at must move exactly the
+// nodes they say they do
+static void test_cursors_splice_split() {
+    DoublyLinkedList dll;
+    for (int i = 0; i < 10; i++) {
+        dll.insert_head(std::to_string(i));
+    }
+    {
+        ListCursor reader;
+        ListCursor deleter;
+        bool placed = cursor_to(dll, reader, "8") && cursor_to(dll, deleter, "8");
+        dll.cursor_erase(deleter);
+        self_check(placed && dll.cursor_next(reader) && reader.data() == "7" && dll.get_length() == 9,
+                   "cursor: a cursor on a deleted node moves on to the node that followed it");
+    }
+
+    DoublyLinkedList rest;
+    int split = -1;
+    {
+        ListCursor cut;
+        if (cursor_to(dll, cut, "4")) {
+            split = dll.split_at(cut, rest);
+        }
+    }
+    self_check(split == 5 && list_strings(dll) == std::vector<std::string>({ "9", "7", "6", "5" }) &&
+                   list_strings(rest) == std::vector<std::string>({ "4", "3", "2", "1", "0" }) &&
+                   dll.get_length() == 4 && rest.get_length() == 5,
+               "split_at: moves the cursor's node and everything after it");
+
+    int spliced = -1;
+    {
+        ListCursor first;
+        ListCursor last;
+        ListCursor position;
+        if (cursor_to(dll, first, "7") && cursor_to(dll, last, "6") && cursor_to(rest, position, "2")) {
+            spliced = dll.splice(first, last, rest, position);
+        }
+    }
+    self_check(spliced == 2 && list_strings(dll) == std::vector<std::string>({ "9", "5" }) &&
+                   list_strings(rest) == std::vector<std::string>({ "4", "3", "2", "7", "6", "1", "0" }) &&
+                   dll.get_length() == 2 && rest.get_length() == 7,
+               "splice: moves the range after the position in the other list");
+}
+
+// The Bloom filter must never rule out a string that is in the list, and must forget deleted ones
+static void test_bloom_contains() {
+    DoublyLinkedList dll;
+    dll.enable_bloom(1 << 16);
+    const char* strings[] = { "abc", "hello", "xyzzy", "list" };
+    for (const char* str : strings) {
+        dll.insert_head(str);
+    }
+    bool present = true;
+    for (const char* str : strings) {
+        present = present && dll.contains(str);
+    }
+    // "list" was inserted last, so it is at the head
+    delete_at_position(dll, 0);
+    self_check(present && !dll.contains("list") && !dll.contains("absent") && dll.contains("abc"),
+               "bloom: contains finds every string in the list and none that aren't");
+}
+
+// Readers and a writer sharing a list with adaptive lock granularity must leave it consistent, and the
+// granularity mustn't change while a strategy that goes around the locks is on
+static void test_adaptive_granularity() {
+    DoublyLinkedList dll;
+    fill_random(dll, 2000, 6);
+    bool set = dll.set_granularity(GRANULARITY_ADAPTIVE);
+    std::atomic<bool> writing(true);
+    std::vector<std::thread> readers;
+    for (int r = 0; r < 3; r++) {
+        readers.emplace_back([&dll, &writing]() {
+            while (writing) {
+                std::string current = dll.get_head_str();
+                while (!current.empty()) {
+                    current = dll.get_next_str();
+                }
+            }
+        });
+    }
+    for (int i = 0; i < 500; i++) {
+        delete_at_position(dll, std::rand() % dll.get_length());
+        dll.insert_head(get_random_str());
+    }
+    writing = false;
+    for (std::thread& reader : readers) {
+        reader.join();
+    }
+    self_check(set && dll.get_length() == 2000 && (int)list_strings(dll).size() == 2000,
+               "granularity: adaptive readers and writer leave the list consistent");
+
+    DoublyLinkedList lazy;
+    lazy.set_lazy_delete(true);
+    self_check(!lazy.set_granularity(GRANULARITY_COARSE), "granularity: refused while lazy deletion is on");
+    lazy.set_lazy_delete(false);
+}
+
+// A traversal whose deadline has already passed must still visit a node per call, so that calling it until it
+// finishes (as worker_func_1 does with --slice) gets to the end
+static void test_traverse_past_deadline() {
+    DoublyLinkedList dll;
+    fill_random(dll, 50, 3);
+    std::vector<std::string> expected = list_strings(dll);
+    std::vector<std::string> visited;
+    ListCursor cursor;
+    int calls = 0;
+    auto past = std::chrono::steady_clock::now() - std::chrono::seconds(1);
+    while (calls < 1000 &&
+           dll.traverse(cursor, [&visited](const std::string& s) { visited.push_back(s); }, past) != TRAVERSE_DONE) {
+        calls++;
+    }
+    self_check(calls < 1000 && visited == expected, "traverse: a past deadline still visits a node per call");
+}
+
+// Run the checks, and report whether they all passed. Checks that need files make them in a fresh directory
+// under /tmp, and remove them again. Usage: self-test
+int self_test(int, char*[]) {
+    char dir_template[] = "/tmp/dll-self-test-XXXXXX";
+    if (mkdtemp(dir_template) == NULL) {
+        std::cerr << "Can't create a directory under /tmp: " << std::strerror(errno) << "\n";
+        return 1;
+    }
+    std::string dir = dir_template;
+    test_serve_pipeline();
+    test_traverse_past_deadline();
+    test_delete_head_during_inserts();
+    test_snapshot_during_sort();
+    test_cursors_splice_split();
+    test_bloom_contains();
+    test_adaptive_granularity();
+    test_lazy_delete_wal(dir);
+    test_wal_crash_mid_checkpoint(dir);
+    test_trace_round_trip(dir);
+    if (rmdir(dir.c_str()) != 0) {
+        std::cerr << "Can't remove " << dir << ": " << std::strerror(errno) << "\n";
+    }
+    std::cout << self_test_checks - self_test_failures << " of " << self_test_checks << " checks passed\n";
+    return (self_test_failures == 0) ? 0 : 1;
 }